@@ -32,7 +32,9 @@ static Value setArrayAtIndex(Value obj, int argCount, Value *args) {
   ObjArray *array = AS_ARRAY(obj);
   int idx = (int)AS_NUMBER(args[0]);
   if (idx >= 0 && idx < array->arr.count) {
+    PRE_WRITE_BARRIER(array);
     setValueArray(&array->arr, idx, &args[1]);
+    WRITE_BARRIER(array, args[1]);
   }
   return args[1];
 }
@@ -45,31 +47,31 @@ void initArrayModule() {
   objArrayPrototype = newPrototype(objPrototype);
   // init array prototype
   ObjString *length_str = copyString("length", 6);
-  length_str->obj.flags = GC_DONT_COLLECT;
+  length_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objArrayPrototype->propsNative, length_str,
            OBJ_VAL((Obj*)newNativeProp(lenArray, NULL, length_str)));
 
   ObjString *set_index_str = copyString("__setitem__", 11);
-  set_index_str->obj.flags = GC_DONT_COLLECT;
+  set_index_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objArrayPrototype->methodsNative, set_index_str,
            OBJ_VAL((Obj*)newNativeMethod(setArrayAtIndex, set_index_str, 2)));
 
 
   ObjString *get_index_str = copyString("__getitem__", 11);
-  get_index_str->obj.flags = GC_DONT_COLLECT;
+  get_index_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objArrayPrototype->methodsNative, get_index_str,
            OBJ_VAL((Obj*)newNativeMethod(getArrayAtIndex, get_index_str, 1)));
 
 
 
   ObjString *push_str = copyString("push", 4);
-  push_str->obj.flags = GC_DONT_COLLECT;
+  push_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objArrayPrototype->methodsNative, push_str,
            OBJ_VAL((Obj*)newNativeMethod(pushArray, push_str, 1)));
 
 
   ObjString *pop_str = copyString("pop", 3);
-  pop_str->obj.flags = GC_DONT_COLLECT;
+  pop_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objArrayPrototype->methodsNative, pop_str,
            OBJ_VAL((Obj*)newNativeMethod(popArray, pop_str, 0)));
 
@@ -83,7 +85,6 @@ void freeArrayModule() {
 
 ObjArray *newArray() {
   ObjArray *array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
-  array->obj.prototype = objArrayPrototype;
   initValueArray(&array->arr);
   return array;
 }
@@ -96,6 +97,7 @@ Value lenArray(Value array) {
 Value popArray(Value array, int argCount, Value *args) {
   (void)argCount;(void)args;
   Value ret;
+  PRE_WRITE_BARRIER(AS_OBJ(array));
   if (popValueArray(&AS_ARRAY(array)->arr, &ret))
     return ret;
   return NIL_VAL;
@@ -103,7 +105,9 @@ Value popArray(Value array, int argCount, Value *args) {
 
 Value pushArray(Value array, int argCount, Value *args) {
   (void)argCount;
+  PRE_WRITE_BARRIER(AS_OBJ(array));
   pushValueArray(&AS_ARRAY(array)->arr, args[0]);
+  WRITE_BARRIER(AS_OBJ(array), args[0]);
   return args[0];
 }
 
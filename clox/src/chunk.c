@@ -1,14 +1,126 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
 #include "compiler.h"
 #include "vm.h"
 
+// index into lines for the run that contains pos
+static int lineIndex(Chunk *chunk, int pos) {
+  int lo = 0, hi = chunk->lineCount -1;
+  while (lo < hi) {
+    int mid = (lo + hi +1) / 2;
+    if (chunk->lines[mid].offset > pos)
+      hi = mid -1;
+    else
+      lo = mid;
+  }
+  return lo;
+}
+
+static void insertLineStart(Chunk *chunk, int idx, int offset, int line) {
+  if (chunk->lineCapacity < chunk->lineCount +1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+                              oldCapacity, chunk->lineCapacity);
+  }
+
+  memmove(&chunk->lines[idx +1], &chunk->lines[idx],
+          sizeof(LineStart) * (chunk->lineCount - idx));
+  chunk->lines[idx].offset = offset;
+  chunk->lines[idx].line = line;
+  ++chunk->lineCount;
+}
+
+// join runs that ended up on the same line
+static void mergeLineStarts(Chunk *chunk) {
+  int to = 0;
+  for (int i = 1; i < chunk->lineCount; ++i) {
+    if (chunk->lines[i].line != chunk->lines[to].line)
+      chunk->lines[++to] = chunk->lines[i];
+  }
+  if (chunk->lineCount > 0)
+    chunk->lineCount = to +1;
+}
+
+#define CONSTANT_LINEAR_MAX 8
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+static uint32_t hashConstant(Value value) {
+  uint64_t bits = 0;
+  if (IS_NUMBER(value)) {
+    // -0 == 0 in valuesEqual, so they must hash the same
+    double num = AS_NUMBER(value) == 0 ? 0 : AS_NUMBER(value);
+    memcpy(&bits, &num, sizeof(num));
+  } else if (IS_OBJ(value)) {
+    bits = (uintptr_t)AS_OBJ(value);
+  } else if (IS_BOOL(value)) {
+    bits = AS_BOOL(value) ? 2 : 1;
+  }
+
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// NaN never equals itself, can't be found again
+static bool isIndexable(Value value) {
+  return !IS_NUMBER(value) || AS_NUMBER(value) == AS_NUMBER(value);
+}
+
+// slot for value, either where it is or the empty slot to insert at
+static int *findConstantSlot(Chunk *chunk, Value value) {
+  uint32_t mask = chunk->constantIndexCapacity -1,
+           idx = hashConstant(value) & mask;
+  for (;;) {
+    int *slot = &chunk->constantIndex[idx];
+    if (*slot == 0 ||
+        valuesEqual(chunk->constants.values[*slot -1], value))
+      return slot;
+    idx = (idx +1) & mask;
+  }
+}
+
+// indexes constants added since last call, a count of 0 rebuilds
+static void indexConstants(Chunk *chunk) {
+  int needed = chunk->constants.count +1;
+  if (chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD < needed ||
+      chunk->constantIndexCount == 0)
+  {
+    int oldCapacity = chunk->constantIndexCapacity,
+        capacity = oldCapacity < 16 ? 16 : oldCapacity;
+    while (capacity * CONSTANT_INDEX_MAX_LOAD < needed)
+      capacity *= 2;
+    chunk->constantIndex = GROW_ARRAY(int, chunk->constantIndex,
+                                      oldCapacity, capacity);
+    chunk->constantIndexCapacity = capacity;
+    memset(chunk->constantIndex, 0, sizeof(int) * capacity);
+    chunk->constantIndexCount = 0;
+  }
+
+  for (; chunk->constantIndexCount < chunk->constants.count;
+       ++chunk->constantIndexCount)
+  {
+    int i = chunk->constantIndexCount;
+    Value value = chunk->constants.values[i];
+    if (!isIndexable(value)) continue;
+    int *slot = findConstantSlot(chunk, value);
+    if (*slot == 0) *slot = i +1;
+  }
+}
+
+// ------------------------------------------------------------
+
 void initChunk(Chunk *chunk) {
   chunk->count = chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->lineCount = chunk->lineCapacity = 0;
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCapacity = chunk->constantIndexCount = 0;
   chunk->module = NULL;
   chunk->compiler = NULL;
   initValueArray(&chunk->constants);
@@ -16,24 +128,36 @@ void initChunk(Chunk *chunk) {
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
   freeValueArray(&chunk->constants);
   FREE(Compiler, chunk->compiler);
   initChunk(chunk);
 }
 
+void clearChunk(Chunk *chunk) {
+  chunk->count = 0;
+  // line runs and index would describe the discarded code
+  chunk->lineCount = 0;
+  chunk->constants.count = 0;
+  chunk->constantIndexCount = 0;
+}
+
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count +1) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code,
       oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines,
-                              oldCapacity, chunk->capacity);
+  }
+
+  if (chunk->lineCount == 0 ||
+      chunk->lines[chunk->lineCount -1].line != line)
+  {
+    insertLineStart(chunk, chunk->lineCount, chunk->count, line);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   ++chunk->count;
 }
 
@@ -43,15 +167,42 @@ void patchChunkPos(Chunk *chunk, uint8_t byte, int pos) {
 }
 
 void patchChunkLine(Chunk *chunk, int line, int pos) {
-  if (chunk->count > pos && pos > -1)
-    chunk->lines[pos] = line;
+  if (chunk->count <= pos || pos < 0) return;
+
+  int idx = lineIndex(chunk, pos),
+      oldLine = chunk->lines[idx].line;
+  if (oldLine == line) return;
+
+  // split run so pos gets a run of its own
+  int end = idx +1 < chunk->lineCount ?
+              chunk->lines[idx +1].offset : chunk->count;
+  if (pos +1 < end)
+    insertLineStart(chunk, idx +1, pos +1, oldLine);
+  if (pos > chunk->lines[idx].offset)
+    insertLineStart(chunk, ++idx, pos, line);
+  else
+    chunk->lines[idx].line = line;
+
+  mergeLineStarts(chunk);
+}
+
+int getChunkLine(Chunk *chunk, int pos) {
+  if (chunk->lineCount == 0 || pos < 0) return 0;
+  return chunk->lines[lineIndex(chunk, pos)].line;
 }
 
 int addConstant(Chunk *chunk, Value value) {
   // prevent to store twice
-  for (int i = 0; i < chunk->constants.count; ++i) {
-    if (valuesEqual(chunk->constants.values[i], value))
-      return i;
+  if (chunk->constants.count <= CONSTANT_LINEAR_MAX) {
+    for (int i = 0; i < chunk->constants.count; ++i) {
+      if (valuesEqual(chunk->constants.values[i], value))
+        return i;
+    }
+  } else if (isIndexable(value)) {
+    indexConstants(chunk);
+    int *slot = findConstantSlot(chunk, value);
+    if (*slot != 0)
+      return *slot -1;
   }
 
   push(value); // for GC
@@ -66,12 +66,28 @@ typedef enum {
   _OP_END
 } OpCode;
 
+// run-length encoded line info, a new entry starts each time
+// line changes, lines are looked up by a binary search on offset
+typedef struct LineStart {
+  int offset; // first byte in code on this line
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   ValueArray constants;
   uint8_t *code;
-  int *lines;
+  LineStart *lines;
+  int lineCount,
+      lineCapacity;
+  // hash index into constants, slot holds constant index +1
+  // only built when constants grows beyond a short linear scan,
+  // constantIndexCount constants are indexed. Set it to 0 whenever
+  // constants are truncated or moved, see clearChunk
+  int *constantIndex;
+  int constantIndexCapacity,
+      constantIndexCount;
   Module *module;
   Compiler *compiler;
 } Chunk;
@@ -80,12 +96,16 @@ typedef struct {
 void initChunk(Chunk *chunk);
 // free memeory from this chunk
 void freeChunk(Chunk *chunk);
+// empty chunk of code, lines and constants, keeps the memory
+void clearChunk(Chunk *chunk);
 // write (add) a bytecode to chunk, line is line source
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 // patch (update) a bytecode at chunk in pos
 void patchChunkPos(Chunk *Chunk, uint8_t byte, int pos);
 // patch (upadate) a line for chunk in pos
 void patchChunkLine(Chunk *chunk, int line, int pos);
+// get source line for bytecode at pos
+int getChunkLine(Chunk *chunk, int pos);
 // add a constant to chunk
 int addConstant(Chunk *chunk, Value value);
 
@@ -8,6 +8,8 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "memory.h"
+#include "prefetch.h"
+#include "compilestats.h"
 
 /*
 (*grammar*)
@@ -85,14 +87,6 @@ extern void refSetGlbl(ObjReference *ref, Value value);
 extern Value refGet(ObjReference *ref);
 extern void refSet(ObjReference *ref, Value value);
 
-typedef struct Parser {
-  Token current,
-        previous,
-        prePrevious;
-  bool hadError,
-       panicMode;
-} Parser;
-
 typedef enum {
   PREC_NONE,
   PREC_ASSIGMENT, // =
@@ -107,7 +101,9 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef struct Parser Parser;
+
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 // for parse table to make precedence work
 typedef struct ParseRule {
@@ -137,31 +133,48 @@ typedef struct ClassCompiler {
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+// all state for one compile, compiles don't share any globals so
+// they can nest, ie. eval and lazy function bodies
+struct Parser {
+  TokenStream tokens;
+  Token current,
+        previous;
+  bool hadError,
+       panicMode;
+  Compiler *compiler; // function currently compiled
+  ClassCompiler *currentClass;
+  Parser *enclosing;  // compile that was active when this one began
+  CompileStats *stats; // NULL unless --compile-stats
+  bool checkOnly;     // code is discarded, see preparseBody
+};
+
+// innermost active compile, GC marks from here. One chain for the
+// process, so compiling is done on the interpreter thread only
+static Parser *activeParser = NULL;
+static bool lazyCompile = false;
 
 // ---------------------------------------------
 
-static void emitBytes(uint8_t byte1, uint8_t byte2);
-static void expression();
-static void statement();
-static void declaration();
-static uint8_t makeConstant(Value value);
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2);
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
+static uint8_t makeConstant(Parser *parser, Value value);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-static void initCompiler(Compiler *compiler, Module *module, FunctionType type);
-static void namedVariable(Token name, bool canAssign);
+static void parsePrecedence(Parser *parser, Precedence precedence);
+static void initCompiler(Parser *parser, Compiler *compiler,
+                         Module *module, FunctionType type);
+static void namedVariable(Parser *parser, Token name, bool canAssign);
 static Token syntheticToken(const char* text);
-static void variable(bool canAssign);
-static int parseString(bool canAssign);
-static void string(bool canAssign);
-static void dict(bool canAssign);
+static void variable(Parser *parser, bool canAssign);
+static int parseString(Parser *parser, bool canAssign);
+static void string(Parser *parser, bool canAssign);
+static void dict(Parser *parser, bool canAssign);
 
 // set a new error at Token pos with error message
-static void errorAt(Token *token, const char *message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(Parser *parser, Token *token, const char *message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
 
   fprintf(stderr, "[line %d] Error", token->line);
 
@@ -172,132 +185,146 @@ static void errorAt(Token *token, const char *message) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  parser->hadError = true;
 }
 
 // same as error, but at current pos instead
-static void errorAtCurrent(const char *message, ...) {
+static void errorAtCurrent(Parser *parser, const char *message, ...) {
   va_list args;
   va_start(args, message);
   char buf[2048] = {0};
   vsnprintf(buf, 2047, message, args);
-  errorAt(&parser.current, buf);
+  errorAt(parser, &parser->current, buf);
   va_end(args);
 }
 
 // set a new error at previous pos
-static void error(const char *message, ...) {
+static void error(Parser *parser, const char *message, ...) {
   va_list args;
   va_start(args, message);
   char buf[2048] = {0};
   vsnprintf(buf, 2047, message, args);
-  errorAt(&parser.previous, buf);
+  errorAt(parser, &parser->previous, buf);
   va_end(args);
 }
 
 // returns the currently used chunk
-static Chunk *currentChunk() {
-  return &current->function->chunk;
+static Chunk *currentChunk(Parser *parser) {
+  return &parser->compiler->function->chunk;
+}
+
+// next token from stream, timed and counted when collecting stats
+static Token scanNext(Parser *parser) {
+  if (parser->stats == NULL)
+    return nextToken(&parser->tokens);
+
+  uint64_t start = statsClock();
+  Token token = nextToken(&parser->tokens);
+  statsAddTime(parser->stats, PHASE_SCAN, start);
+  parser->stats->tokens++;
+  return token;
 }
 
 // move provard in token list
-static void advance() {
-  parser.prePrevious = parser.previous;
-  parser.previous = parser.current;
+static void advance(Parser *parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
+    parser->current = scanNext(parser);
+    if (parser->current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
 // consume token or report error message
-static void consume(TokenType type, const char *message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser *parser, TokenType type, const char *message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(parser, message);
 }
 
 // check if Token is of type
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
 }
 
 // check and advance if tokenType check succeeds
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(Parser *parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
 
 // emit a single byte to bytecode
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser *parser, uint8_t byte) {
+  writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
 // emit 2 bytes to byteCode
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
 }
 
 // emit a jump backward to bytecode, must be pacthed later
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitLoop(Parser *parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
 
-  int offset = currentChunk()->count - loopStart +2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk(parser)->count - loopStart +2;
+  if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
 }
 
 // emit a jump forward to bytecode, must be patched later
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xFF);
-  emitByte(0xFF);
-  return currentChunk()->count - 2;
+static int emitJump(Parser *parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitByte(parser, 0xFF);
+  emitByte(parser, 0xFF);
+  return currentChunk(parser)->count - 2;
 }
 
 // emit a empty return statment explicit or implicit
-static void emitNilReturn() {
-  if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL, 0);
+static void emitNilReturn(Parser *parser) {
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
 
-  emitByte(OP_RETURN);
+  emitByte(parser, OP_RETURN);
 }
 
 // emit byteCode for constant value
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser *parser, Value value) {
+  emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
 // patch a jump when code size i known
-static void patchJump(int offset) {
+static void patchJump(Parser *parser, int offset) {
   // -2 to adjust for the byteCode for the jump offset itself
-  int jump = currentChunk()->count - offset -2;
+  int jump = currentChunk(parser)->count - offset -2;
 
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    error(parser, "Too much code to jump over.");
   }
 
-  uint8_t *code = currentChunk()->code;
+  uint8_t *code = currentChunk(parser)->code;
   code[offset] = (jump >> 8) &0xff;
   code[offset + 1] = jump & 0xff;
 }
 
 // creates a new identifier and adds to constants table
-static uint8_t identifierConstant(Token *name) {
-  return makeConstant(OBJ_VAL(OBJ_CAST(copyString(name->start, name->length))));
+static uint8_t identifierConstant(Parser *parser, Token *name) {
+  uint64_t start = statsClock();
+  ObjString *identifier = copyString(name->start, name->length);
+  statsAddTime(parser->stats, PHASE_CONSTANTS, start);
+  return makeConstant(parser, OBJ_VAL(OBJ_CAST(identifier)));
 }
 
 // check if idenfiers are equal
@@ -307,13 +334,13 @@ static bool identifiersEqual(Token *a, Token *b) {
 }
 
 // lookup a local variable
-static int resolveLocal(Compiler *compiler, Token *name) {
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name) {
   if (compiler == NULL) return -1;
   for (int i = compiler->localCount -1; i >= 0; --i) {
     Local *local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -323,7 +350,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
 }
 
 // add a new closure value
-static int addUpvalue(Compiler *compiler, uint8_t index,
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index,
                       bool isLocal)
 {
   int upvalueCount = compiler->function->upvalueCount;
@@ -335,7 +362,7 @@ static int addUpvalue(Compiler *compiler, uint8_t index,
   }
 
   if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
 
@@ -344,33 +371,46 @@ static int addUpvalue(Compiler *compiler, uint8_t index,
   return compiler->function->upvalueCount++;
 }
 
+// lookup a closure value in a function compiled out of line, its
+// enclosing compiler is done so only what preparse found is valid
+static int resolveLazyUpvalue(Compiler *compiler, Token *name) {
+  for (int i = compiler->function->upvalueCount -1; i >= 0; --i) {
+    if (identifiersEqual(name, &compiler->upvalueNames[i]))
+      return i;
+  }
+  return -1;
+}
+
 // lookup a closure value
-static int resolveUpValue(Compiler *compiler, Token *name) {
+static int resolveUpValue(Parser *parser, Compiler *compiler, Token *name) {
   //if (compiler->enclosing == NULL) return -1;
   if (compiler == NULL) return -1;
 
-  int local = resolveLocal(compiler, name);
+  int local = resolveLocal(parser, compiler, name);
   if (local != -1) {
     compiler->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(parser, compiler, (uint8_t)local, true);
   }
 
-  int upvalue = resolveUpValue(compiler->enclosing, name);
+  if (compiler->bodyStart != NULL)
+    return resolveLazyUpvalue(compiler, name);
+
+  int upvalue = resolveUpValue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
   }
 
   return -1;
 }
 
 // add a new local to current frame
-static void addLocal(Token name, bool isReference) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(Parser *parser, Token name, bool isReference) {
+  if (parser->compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
     return;
   }
 
-  Local *local = &current->locals[current->localCount++];
+  Local *local = &parser->compiler->locals[parser->compiler->localCount++];
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
@@ -378,22 +418,22 @@ static void addLocal(Token name, bool isReference) {
 }
 
 // lookup variable and set access operators used to retrieve varable
-static int variableAccessOp(Token *name, uint8_t *getOp,
+static int variableAccessOp(Parser *parser, Token *name, uint8_t *getOp,
                              uint8_t *setOp)
 {
-  int arg = resolveLocal(current, name);
+  int arg = resolveLocal(parser, parser->compiler, name);
   if (arg != -1) {
-    if (current->locals[arg].isReference) {
+    if (parser->compiler->locals[arg].isReference) {
       *getOp = OP_GET_REFERENCE;
       *setOp = OP_SET_REFERENCE;
     } else {
       *getOp = OP_GET_LOCAL;
       *setOp = OP_SET_LOCAL;
     }
-  } else if ((arg = resolveUpValue(current, name)) != -1) {
+  } else if ((arg = resolveUpValue(parser, parser->compiler, name)) != -1) {
     *getOp = OP_GET_UPVALUE;
     *setOp = OP_SET_UPVALUE;
-  } else if ((arg = identifierConstant(name)) != -1) {
+  } else if ((arg = identifierConstant(parser, name)) != -1) {
     if (tableHasKey(&vm.globals, copyString(name->start, name->length))){
       *getOp = OP_GET_GLOBAL;
       *setOp = OP_SET_GLOBAL;
@@ -409,115 +449,122 @@ static int variableAccessOp(Token *name, uint8_t *getOp,
 }
 
 // declare a new variable ie: var tmp;
-static void declareVariable(bool isReference) {
+static void declareVariable(Parser *parser, bool isReference) {
   //if (current->scopeDepth == 0) return;
 
-  Token *name = &parser.previous;
-  for (int i = 0; i < current->localCount; ++i) {
-    Local *local = & current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
+  Token *name = &parser->previous;
+  for (int i = 0; i < parser->compiler->localCount; ++i) {
+    Local *local = & parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
       break;
     }
 
     if (identifiersEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
     }
   }
 
-  addLocal(*name, isReference);
+  addLocal(parser, *name, isReference);
 }
 
 // context switch for parser, to get the correct parse precedence
 // . has higher precedence than =
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser *parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("Expect expression");
+    error(parser, "Expect expression");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
   }
 }
 
 // parse a variable
-static uint8_t parseVariable(const char *errorMessage, bool isReference) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static uint8_t parseVariable(Parser *parser, const char *errorMessage,
+                             bool isReference)
+{
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-  declareVariable(isReference);
+  declareVariable(parser, isReference);
   //if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierConstant(parser, &parser->previous);
 }
 
 // mark a variable as initialized
-static void markInitialized() {
+static void markInitialized(Parser *parser) {
   //if (current->scopeDepth == 0) return;
-  current->locals[current->localCount -1].depth =
-    current->scopeDepth;
+  parser->compiler->locals[parser->compiler->localCount -1].depth =
+    parser->compiler->scopeDepth;
 }
 
 // define a variable ie the: = value part ov var v = value;
-static void defineVariable(uint8_t global) {
+static void defineVariable(Parser *parser, uint8_t global) {
   //if (current->scopeDepth > 0) {
-    markInitialized();
+    markInitialized(parser);
     return;
  // }
  // emitBytes(OP_DEFINE_GLOBAL, global);
 }
 
 // parse a function arguments list
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser *parser) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
+      expression(parser);
       if (argCount == 255) {
-        error("Can't have more than 255 arguments.");
+        error(parser, "Can't have more than 255 arguments.");
       }
       argCount++;
-    } while(match(TOKEN_COMMA));
+    } while(match(parser, TOKEN_COMMA));
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;
 }
 
 // parse a and statemen, ie: if (v == 0 and t == 1) ...
-static void and_(bool canAssign) {
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser *parser, bool canAssign) {
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
 
-  patchJump(endJump);
+  patchJump(parser, endJump);
 }
 
 // parse a or statement ie: if (v == 0 or t == 1) ...
-static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+static void or_(Parser *parser, bool canAssign) {
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
 }
 
 // creates, checks and adds, a Value constant
 // such as identifiers, number literals, strings literals etc.
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser *parser, Value value) {
+  uint64_t start = statsClock();
+  int constant = addConstant(currentChunk(parser), value);
+  if (parser->stats != NULL) {
+    statsAddTime(parser->stats, PHASE_CONSTANTS, start);
+    parser->stats->constantCalls++;
+  }
   if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+    error(parser, "Too many constants in one chunk.");
     return 0;
   }
 
@@ -525,197 +572,254 @@ static uint8_t makeConstant(Value value) {
 }
 
 // end a function frame (compiled chunk)
-static ObjFunction *endCompiler() {
-  if (current->function->chunk.count == 0 ||
-      current->function->chunk.code[
-          current->function->chunk.count-1] != OP_RETURN)
+static ObjFunction *endCompiler(Parser *parser) {
+  if (parser->compiler->function->chunk.count == 0 ||
+      parser->compiler->function->chunk.code[
+          parser->compiler->function->chunk.count-1] != OP_RETURN)
   {
-    emitNilReturn();
+    emitNilReturn(parser);
+  }
+  ObjFunction *function = parser->compiler->function;
+  // a lazily compiled body adds constants to an older function
+  writeBarrierObject(OBJ_CAST(function));
+  if (parser->stats != NULL && !parser->checkOnly) {
+    parser->stats->bytecodeBytes += function->chunk.count;
+    parser->stats->constants += function->chunk.constants.count;
+    parser->stats->functions++;
   }
-  ObjFunction *function = current->function;
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(), "code");
+  if (!parser->hadError && !parser->checkOnly) {
+    disassembleChunk(currentChunk(parser), "code");
   }
 #endif
 
-  if (current->type != TYPE_SCRIPT)
-    current = current->enclosing;
+  if (parser->compiler->type != TYPE_SCRIPT)
+    parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
 // begin a new scope
-static void beginScope() {
-  current->scopeDepth++;
+static void beginScope(Parser *parser) {
+  parser->compiler->scopeDepth++;
 }
 
 // end current scope
-static void endScope() {
-  current->scopeDepth--;
+static void endScope(Parser *parser) {
+  parser->compiler->scopeDepth--;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount-1].depth >
-           current->scopeDepth)
+  while (parser->compiler->localCount > 0 &&
+         parser->compiler->locals[parser->compiler->localCount-1].depth >
+           parser->compiler->scopeDepth)
   {
-    if (current->locals[current->localCount -1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
+    if (parser->compiler->locals[parser->compiler->localCount -1].isCaptured) {
+      emitByte(parser, OP_CLOSE_UPVALUE);
     } else {
-      emitByte(OP_POP);
+      emitByte(parser, OP_POP);
     }
-    current->localCount--;
+    parser->compiler->localCount--;
   }
 }
 
 // parses a expression
-static void expression() {
-  parsePrecedence(PREC_ASSIGMENT);
+static void expression(Parser *parser) {
+  parsePrecedence(parser, PREC_ASSIGMENT);
 }
 
 // parses a code block ie: { ... }
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser *parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void functionUpvalues(Compiler *compiler, ObjFunction *function) {
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(OBJ_CAST(function))));
+static void functionUpvalues(Parser *parser, Compiler *compiler,
+                             ObjFunction *function)
+{
+  emitBytes(parser, OP_CLOSURE,
+            makeConstant(parser, OBJ_VAL(OBJ_CAST(function))));
 
   for (int i = 0; i < function->upvalueCount; ++i) {
-    emitByte(compiler->upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler->upvalues[i].index);
+    emitByte(parser, compiler->upvalues[i].isLocal ? 1 : 0);
+    emitByte(parser, compiler->upvalues[i].index);
+  }
+}
+
+// check a function body without keeping its code, it is parsed and
+// resolved by the real compiler so errors are reported as eagerly,
+// then the code is discarded and made again on first call. Upvalues
+// are found as in a full compile. Only functions directly in script
+// are preparsed, returns false if body must be compiled now.
+static bool preparseBody(Parser *parser, Compiler *compiler) {
+  if (!lazyCompile || compiler->enclosing == NULL ||
+      compiler->enclosing->type != TYPE_SCRIPT)
+    return false;
+
+  Token bodyStart = parser->current;
+  int localCount = compiler->localCount,
+      scopeDepth = compiler->scopeDepth;
+  bool checkOnly = parser->checkOnly;
+  parser->checkOnly = true;
+  block(parser);
+  parser->checkOnly = checkOnly;
+  clearChunk(&compiler->function->chunk);
+  compiler->localCount = localCount;
+  compiler->scopeDepth = scopeDepth;
+
+  // by name only those from the script, an upvalue of a local of
+  // the body itself is resolved as a local again, see addUpvalue
+  int upvalueCount = compiler->function->upvalueCount;
+  if (upvalueCount > 0) {
+    Compiler *script = compiler->enclosing;
+    compiler->upvalueNames = ALLOCATE(Token, upvalueCount);
+    for (int i = 0; i < upvalueCount; ++i) {
+      Upvalue *upvalue = &compiler->upvalues[i];
+      compiler->upvalueNames[i] = upvalue->isLocal ?
+        syntheticToken("") :
+        script->locals[script->upvalues[upvalue->index].index].name;
+    }
   }
+  compiler->bodyStart = bodyStart.start;
+  compiler->bodyLine = bodyStart.line;
+  compiler->inClass = parser->currentClass != NULL;
+  compiler->hasSuperclass = parser->currentClass != NULL &&
+                            parser->currentClass->hasSuperclass;
+  return true;
 }
 
 // parses a function
-static void function(FunctionType type) {
+static void function(Parser *parser, FunctionType type) {
   Compiler *compiler = ALLOCATE(Compiler, 1);
-  initCompiler(compiler, current->function->chunk.module, type);
-  beginScope();
+  initCompiler(parser, compiler,
+               parser->compiler->function->chunk.module, type);
+  beginScope(parser);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters");
       }
-      uint8_t constant = parseVariable("Expect parameter name.", false);
-      defineVariable(constant);
-    } while(match(TOKEN_COMMA));
+      uint8_t constant = parseVariable(parser, "Expect parameter name.", false);
+      defineVariable(parser, constant);
+    } while(match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  if (preparseBody(parser, compiler)) {
+    parser->compiler = compiler->enclosing;
+  } else {
+    block(parser);
+    endCompiler(parser);
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
 
-  ObjFunction *function = endCompiler();
-  functionUpvalues(compiler, function);
+  functionUpvalues(parser, compiler, compiler->function);
 }
 
 // declare a class method
-static void method() {
-  consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(parser, &parser->previous);
 
   FunctionType type = TYPE_METHOD;
-  if (parser.previous.length == 4 &&
-      memcmp(parser.previous.start, "init", 4) == 0)
+  if (parser->previous.length == 4 &&
+      memcmp(parser->previous.start, "init", 4) == 0)
   {
     type = TYPE_INITIALIZER;
   }
-  function(type);
-  emitBytes(OP_METHOD, constant);
+  function(parser, type);
+  emitBytes(parser, OP_METHOD, constant);
 }
 
 // declare a class
-static void classDeclaration() {
-  consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
-  declareVariable(false);
+static void classDeclaration(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->previous;
+  uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+  declareVariable(parser, false);
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitBytes(parser, OP_CLASS, nameConstant);
+  defineVariable(parser, nameConstant);
 
   ClassCompiler classCompiler;
-  classCompiler.enclosing = currentClass;
+  classCompiler.enclosing = parser->currentClass;
   classCompiler.hasSuperclass = false;
-  currentClass = &classCompiler;
+  parser->currentClass = &classCompiler;
 
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-    variable(false);
-    if (identifiersEqual(&className, &parser.previous)) {
-      error("A class can't inherit from itself.");
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
+    if (identifiersEqual(&className, &parser->previous)) {
+      error(parser, "A class can't inherit from itself.");
     }
 
-    beginScope();
-    addLocal(syntheticToken("super"), false);
-    defineVariable(0);
+    beginScope(parser);
+    addLocal(parser, syntheticToken("super"), false);
+    defineVariable(parser, 0);
 
-    namedVariable(className, false);
-    emitByte(OP_INHERIT);
+    namedVariable(parser, className, false);
+    emitByte(parser, OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
 
-  namedVariable(className, false);
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    method();
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-  emitByte(OP_POP);
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
 
   if (classCompiler.hasSuperclass) {
-    endScope();
+    endScope(parser);
   }
 
-  currentClass = currentClass->enclosing;
+  parser->currentClass = parser->currentClass->enclosing;
 }
 
 // declare a function
-static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name", false);
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+static void funDeclaration(Parser *parser) {
+  uint8_t global = parseVariable(parser, "Expect function name", false);
+  markInitialized(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
 }
 
 // declare a variable ie. var v = 1;
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.", false);
+static void varDeclaration(Parser *parser) {
+  uint8_t global = parseVariable(parser, "Expect variable name.", false);
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
 
-  if (check(TOKEN_COMMA)) {
-    advance();
-    defineVariable(global);
-    varDeclaration();
+  if (check(parser, TOKEN_COMMA)) {
+    advance(parser);
+    defineVariable(parser, global);
+    varDeclaration(parser);
   } else {
-    consume(TOKEN_SEMICOLON,
+    consume(parser, TOKEN_SEMICOLON,
           "Expect ';' after variable declaration.");
-    defineVariable(global);
+    defineVariable(parser, global);
   }
 }
 
 // expresions starts here
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);
 }
 
 // updates a previous set jump statment to correct position when
 // code postition is known
-static void patchLoopGotoJumps(PatchJump** jump, int pos) {
+static void patchLoopGotoJumps(Parser *parser, PatchJump** jump, int pos) {
   PatchJump *jmp = *jump, *freeMe;
-  uint8_t *code = currentChunk()->code;
+  uint8_t *code = currentChunk(parser)->code;
 
   while (jmp != NULL) {
     int jump;
@@ -731,7 +835,7 @@ static void patchLoopGotoJumps(PatchJump** jump, int pos) {
     assert(jump > 0);
 
     if (jump > UINT16_MAX)
-      error("Too much code to jump over.");
+      error(parser, "Too much code to jump over.");
 
     code[jmp->patchPos] = (jump >> 8) & 0xff;
     code[jmp->patchPos + 1] = jump & 0xff;
@@ -743,202 +847,207 @@ static void patchLoopGotoJumps(PatchJump** jump, int pos) {
 }
 
 // handles for statement
-static void forStatement() {
-  beginScope();
+static void forStatement(Parser *parser) {
+  beginScope(parser);
 
   LoopJumps loopJmp;
   loopJmp.patchBreak = loopJmp.patchContinue = NULL;
-  loopJmp.next = current->loopJumps;
-  current->loopJumps = &loopJmp;
+  loopJmp.next = parser->compiler->loopJumps;
+  parser->compiler->loopJumps = &loopJmp;
 
   // for (var i = 0; ....)
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
-    consume(TOKEN_SEMICOLON, "Expect ';' .");
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' .");
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 
-  int loopStart = currentChunk()->count;
+  int loopStart = currentChunk(parser)->count;
   // for (..; i < 10; ....)
   int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // jump out of loop if condition is false
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // condition
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP); // condition
   }
 
   // for (...;...; i++)
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-    emitLoop(loopStart);
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP);
+    int incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    emitLoop(parser, loopStart);
     loopStart = incrementStart;
-    patchJump(bodyJump);
+    patchJump(parser, bodyJump);
   }
 
-  statement();
-  emitLoop(loopStart);
+  statement(parser);
+  emitLoop(parser, loopStart);
 
   // bail out on false condition
   if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
   }
 
-  patchLoopGotoJumps(&loopJmp.patchContinue, loopStart);
-  patchLoopGotoJumps(&loopJmp.patchBreak, currentChunk()->count);
+  patchLoopGotoJumps(parser, &loopJmp.patchContinue, loopStart);
+  patchLoopGotoJumps(parser, &loopJmp.patchBreak, currentChunk(parser)->count);
 
-  endScope();
-  current->loopJumps = loopJmp.next;
+  endScope(parser);
+  parser->compiler->loopJumps = loopJmp.next;
 }
 
 // handles if statement
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser *parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
 
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(parser, OP_JUMP);
 
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
 
-  if (match(TOKEN_ELSE)) statement();
-  patchJump(elseJump);
+  if (match(parser, TOKEN_ELSE)) statement(parser);
+  patchJump(parser, elseJump);
 }
 
 // handles print statment
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-  if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code.");
+static void returnStatement(Parser *parser) {
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {
-    emitNilReturn();
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitNilReturn(parser);
   } else {
-    if (current->type == TYPE_INITIALIZER) {
-      error("Can't return a value from an initializer.");
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "Can't return a value from an initializer.");
     }
 
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitByte(parser, OP_RETURN);
   }
 }
 
 // handles while statements
-static void whileStatement() {
+static void whileStatement(Parser *parser) {
   LoopJumps loopJmp;
   loopJmp.patchBreak = loopJmp.patchContinue = NULL;
-  loopJmp.next = current->loopJumps;
-  current->loopJumps = &loopJmp;
+  loopJmp.next = parser->compiler->loopJumps;
+  parser->compiler->loopJumps = &loopJmp;
 
-  int loopStart = currentChunk()->count;
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after while.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  int loopStart = currentChunk(parser)->count;
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after while.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
 
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
 
-  emitLoop(loopStart);
-  patchJump(endJump);
-  patchLoopGotoJumps(&loopJmp.patchContinue, loopStart);
-  patchLoopGotoJumps(&loopJmp.patchBreak, currentChunk()->count);
-  emitByte(OP_POP);
+  emitLoop(parser, loopStart);
+  patchJump(parser, endJump);
+  patchLoopGotoJumps(parser, &loopJmp.patchContinue, loopStart);
+  patchLoopGotoJumps(parser, &loopJmp.patchBreak, currentChunk(parser)->count);
+  emitByte(parser, OP_POP);
 
-  current->loopJumps = loopJmp.next;
+  parser->compiler->loopJumps = loopJmp.next;
 }
 
 // parses a import param ie: id1 as id in
 // import {id1 as id} from "path.lox"
-static void importParam() {
+static void importParam(Parser *parser) {
 
   uint8_t nameInExport, alias;
-  nameInExport = identifierConstant(&parser.current);
+  nameInExport = identifierConstant(parser, &parser->current);
 
-  if (scanPeek(1).type == TOKEN_AS) {
-    advance(); advance();
+  if (peekToken(&parser->tokens, 1).type == TOKEN_AS) {
+    advance(parser); advance(parser);
   }
-  Token identToken = parser.current;
-  alias = parseVariable("Expect IDENTIFIER in import statement.\n", true);
-  markInitialized();
+  Token identToken = parser->current;
+  alias = parseVariable(parser,
+                        "Expect IDENTIFIER in import statement.\n", true);
+  markInitialized(parser);
 
   uint8_t getOp, setOp;
-  int varIdx = variableAccessOp(&identToken, &getOp, &setOp);
+  int varIdx = variableAccessOp(parser, &identToken, &getOp, &setOp);
 
-  emitBytes(OP_IMPORT_VARIABLE, nameInExport);
-  emitBytes(alias, varIdx);
+  emitBytes(parser, OP_IMPORT_VARIABLE, nameInExport);
+  emitBytes(parser, alias, varIdx);
 }
 
 // parses a import statement, ie:
 // import {id1 as id, id2} from "path.lox"
-static void importStatement() {
-  consume(TOKEN_LEFT_BRACE, "Expect '{' after import.");
-  Chunk *chunk = currentChunk();
-  emitBytes(OP_IMPORT_MODULE, 0xff);
+static void importStatement(Parser *parser) {
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' after import.");
+  Chunk *chunk = currentChunk(parser);
+  emitBytes(parser, OP_IMPORT_MODULE, 0xff);
   int stringPos = chunk->count-1;
 
   do {
-    importParam();
-    if (!check(TOKEN_COMMA)) break;
-    else advance();
+    importParam(parser);
+    if (!check(parser, TOKEN_COMMA)) break;
+    else advance(parser);
   } while(true);
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' in import statement.");
-  consume(TOKEN_FROM, "Expect 'from' after import params.");
-  advance();
-  patchChunkPos(chunk, parseString(false), stringPos);
-  consume(TOKEN_SEMICOLON, "Expect ';' after path.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' in import statement.");
+  consume(parser, TOKEN_FROM, "Expect 'from' after import params.");
+  advance(parser);
+  uint8_t pathIdx = parseString(parser, false);
+  patchChunkPos(chunk, pathIdx, stringPos);
+  // start reading it while we compile the rest
+  prefetchSource(AS_CSTRING(chunk->constants.values[pathIdx]));
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after path.");
 }
 
-static void exportIdentifier(Token *identToken) {
+static void exportIdentifier(Parser *parser, Token *identToken) {
   ObjString *ident = copyString(identToken->start,
                                 identToken->length);
   uint8_t getOp, setOp;
-  int varIdx = variableAccessOp(identToken, &getOp, &setOp);
+  int varIdx = variableAccessOp(parser, identToken, &getOp, &setOp);
   if (varIdx < 0) {
-    errorAtCurrent("Identifier '%s' not found.\n", ident->chars);
+    errorAtCurrent(parser, "Identifier '%s' not found.\n", ident->chars);
     return;
   } else if (getOp == OP_GET_GLOBAL) {
-    errorAtCurrent("Can't export '%s' because it's a global.\n", ident->chars);
+    errorAtCurrent(parser, "Can't export '%s' because it's a global.\n",
+                   ident->chars);
     return;
   }
 
-  int identIdx = identifierConstant(identToken);
-  ObjModule *mod = newModule(current->function->chunk.module);
+  int identIdx = identifierConstant(parser, identToken);
+  ObjModule *mod = newModule(parser->compiler->function->chunk.module);
 
-  int upIdx = resolveUpValue(current, identToken);
+  int upIdx = resolveUpValue(parser, parser->compiler, identToken);
   ObjReference *ref = newReference(
-                        ident, mod, upIdx, &current->function->chunk);
+                        ident, mod, upIdx, &parser->compiler->function->chunk);
 
-  emitBytes(OP_EXPORT, identIdx);
-  emitBytes(varIdx, upIdx);
-  tableSet(&current->function->chunk.module->exports,
+  emitBytes(parser, OP_EXPORT, identIdx);
+  emitBytes(parser, varIdx, upIdx);
+  tableSet(&parser->compiler->function->chunk.module->exports,
            ident, OBJ_VAL(ref));
-  advance();
+  advance(parser);
 }
 
 /*
@@ -947,40 +1056,40 @@ exportStmt     -> "export" ( dictDecl
                            | classDecl
                            | identifier ) ;
                            */
-static void exportDeclaration(int depth) {
-  advance();
-  Token identToken = parser.current;;
-  switch (parser.previous.type) {
+static void exportDeclaration(Parser *parser, int depth) {
+  advance(parser);
+  Token identToken = parser->current;;
+  switch (parser->previous.type) {
   case TOKEN_LEFT_BRACE: // begin {...} exports
-    while (check(TOKEN_IDENTIFIER)) {
-      exportIdentifier(&parser.current);
-      if (!check(TOKEN_RIGHT_BRACE)) advance();
+    while (check(parser, TOKEN_IDENTIFIER)) {
+      exportIdentifier(parser, &parser->current);
+      if (!check(parser, TOKEN_RIGHT_BRACE)) advance(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after export list.\n");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after export list.\n");
     break;
   case TOKEN_FUN:
-    funDeclaration();
-    exportIdentifier(&identToken);
+    funDeclaration(parser);
+    exportIdentifier(parser, &identToken);
     break;
   case TOKEN_CLASS:
-    classDeclaration();
-    exportIdentifier(&identToken);
+    classDeclaration(parser);
+    exportIdentifier(parser, &identToken);
     break;
   case TOKEN_IDENTIFIER:
-    exportIdentifier(&parser.previous); break;
+    exportIdentifier(parser, &parser->previous); break;
   default:
-    errorAt(&parser.previous, "Expect valid export. \n");
+    errorAt(parser, &parser->previous, "Expect valid export. \n");
   }
 }
 
 // when a recoverable syntax error occurs,
 // so we can get many syntax errors roprted at the same time.
-static void syncronize() {
-  parser.panicMode = false;
+static void syncronize(Parser *parser) {
+  parser->panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
-    switch (parser.current.type) {
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
+    switch (parser->current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_VAR:
@@ -995,67 +1104,67 @@ static void syncronize() {
     default: ; // do nothing
     }
 
-    advance();
+    advance(parser);
   }
 }
 
 // create a break/continue jump data struct
 // is used later for pathcing when loop is finished
-static PatchJump *loopGotoJump(const char *errMsg) {
-  if (current->loopJumps == NULL) {
-    errorAtCurrent(errMsg);
+static PatchJump *loopGotoJump(Parser *parser, const char *errMsg) {
+  if (parser->compiler->loopJumps == NULL) {
+    errorAtCurrent(parser, errMsg);
     return NULL;
   }
 
   PatchJump *jump = (PatchJump*)ALLOCATE(PatchJump, 1);
   if (jump == NULL) {
-    error("Could not allocate memory during parsing.");
+    error(parser, "Could not allocate memory during parsing.");
     return NULL;
   }
 
   jump->next = NULL;
-  jump->patchPos = emitJump(OP_JUMP);
+  jump->patchPos = emitJump(parser, OP_JUMP);
   return jump;
 }
 
 // top level, it starts from here
-static void declaration() {
-  switch (parser.current.type) {
-  case TOKEN_CLASS:  advance(); classDeclaration(); break;
-  case TOKEN_FUN:    advance(); funDeclaration(); break;
-  case TOKEN_VAR:    advance(); varDeclaration(); break;
-  case TOKEN_EXPORT: advance(); exportDeclaration(0); break;
+static void declaration(Parser *parser) {
+  switch (parser->current.type) {
+  case TOKEN_CLASS:  advance(parser); classDeclaration(parser); break;
+  case TOKEN_FUN:    advance(parser); funDeclaration(parser); break;
+  case TOKEN_VAR:    advance(parser); varDeclaration(parser); break;
+  case TOKEN_EXPORT: advance(parser); exportDeclaration(parser, 0); break;
   default:
-    statement();
+    statement(parser);
   }
 
-  if (parser.panicMode) syncronize();
+  if (parser->panicMode) syncronize(parser);
 }
 
 // parse a statement
-static void statement() {
-  switch (parser.current.type) {
-  case TOKEN_PRINT:  advance(); printStatement(); break;
-  case TOKEN_FOR:    advance(); forStatement(); break;
-  case TOKEN_IF:     advance(); ifStatement(); break;
-  case TOKEN_RETURN: advance(); returnStatement(); break;
-  case TOKEN_WHILE:  advance(); whileStatement(); break;
-  case TOKEN_IMPORT: advance(); importStatement(); break;
+static void statement(Parser *parser) {
+  switch (parser->current.type) {
+  case TOKEN_PRINT:  advance(parser); printStatement(parser); break;
+  case TOKEN_FOR:    advance(parser); forStatement(parser); break;
+  case TOKEN_IF:     advance(parser); ifStatement(parser); break;
+  case TOKEN_RETURN: advance(parser); returnStatement(parser); break;
+  case TOKEN_WHILE:  advance(parser); whileStatement(parser); break;
+  case TOKEN_IMPORT: advance(parser); importStatement(parser); break;
   default:
-    if (match(TOKEN_LEFT_BRACE)) {
-      beginScope();
-      block();
-      endScope();
+    if (match(parser, TOKEN_LEFT_BRACE)) {
+      beginScope(parser);
+      block(parser);
+      endScope(parser);
     } else {
-      expressionStatement();
+      expressionStatement(parser);
     }
   }
 }
 
 // parse a number
-static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+static void number(Parser *parser, bool canAssign) {
+  double value = strtod(parser->previous.start, NULL);
+  emitConstant(parser, NUMBER_VAL(value));
 }
 
 // escape strings such as \n \t
@@ -1081,30 +1190,31 @@ static int escapeString(char *to, const char *from, int len) {
   return to - start;
 }
 
-static int parseString(bool canAssign) {
-  char *escStr = ALLOCATE(char, parser.previous.length-2);
+static int parseString(Parser *parser, bool canAssign) {
+  char *escStr = ALLOCATE(char, parser->previous.length-2);
   int len = escapeString(
-    escStr, parser.previous.start+1, parser.previous.length-2);
+    escStr, parser->previous.start+1, parser->previous.length-2);
 
-  uint8_t idx = makeConstant(OBJ_VAL(OBJ_CAST(copyString(escStr, len))));
-  FREE_ARRAY(char, escStr, parser.previous.length-2);
+  uint8_t idx = makeConstant(parser,
+                             OBJ_VAL(OBJ_CAST(copyString(escStr, len))));
+  FREE_ARRAY(char, escStr, parser->previous.length-2);
   return idx;
 }
 
 // parse a string
-static void string(bool canAssign) {
-  uint8_t idx = parseString(canAssign);
-  emitBytes(OP_CONSTANT, idx);
+static void string(Parser *parser, bool canAssign) {
+  uint8_t idx = parseString(parser, canAssign);
+  emitBytes(parser, OP_CONSTANT, idx);
 }
 
 // returns which assigment set is used is: +=, -= ...
-static OpCode mutate(bool canAssign) {
+static OpCode mutate(Parser *parser, bool canAssign) {
   if (canAssign) {
-    switch (parser.current.type) {
-    case TOKEN_PLUS_EQUAL:  advance(); return OP_ADD;
-    case TOKEN_MINUS_EQUAL: advance(); return OP_SUBTRACT;
-    case TOKEN_STAR_EQUAL:  advance(); return OP_MULTIPLY;
-    case TOKEN_SLASH_EQUAL: advance(); return OP_DIVIDE;
+    switch (parser->current.type) {
+    case TOKEN_PLUS_EQUAL:  advance(parser); return OP_ADD;
+    case TOKEN_MINUS_EQUAL: advance(parser); return OP_SUBTRACT;
+    case TOKEN_STAR_EQUAL:  advance(parser); return OP_MULTIPLY;
+    case TOKEN_SLASH_EQUAL: advance(parser); return OP_DIVIDE;
     default: break;
     }
   }
@@ -1113,32 +1223,32 @@ static OpCode mutate(bool canAssign) {
 }
 
 // get a variable previously declared
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = variableAccessOp(&name, &getOp, &setOp);
+  int arg = variableAccessOp(parser, &name, &getOp, &setOp);
   if (arg < 0) {
-    error("Identifier not found.\n");
-    parser.panicMode = true;
+    error(parser, "Identifier not found.\n");
+    parser->panicMode = true;
     return;
   }
 
-  OpCode mutateCode = mutate(canAssign);
+  OpCode mutateCode = mutate(parser, canAssign);
   if (mutateCode != OP_NIL) {
-    emitBytes(getOp, arg);
-    expression();
-    emitByte(mutateCode);
-    emitBytes(setOp, arg);
-  } else if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, arg);
+    emitBytes(parser, getOp, arg);
+    expression(parser);
+    emitByte(parser, mutateCode);
+    emitBytes(parser, setOp, arg);
+  } else if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitBytes(parser, setOp, arg);
   } else {
-    emitBytes(getOp, arg);
+    emitBytes(parser, getOp, arg);
   }
 }
 
 // parse a variable
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser *parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
 }
 
 // create a custom token, containing text
@@ -1150,204 +1260,204 @@ static Token syntheticToken(const char* text) {
 }
 
 // parse a break statement
-static void break_(bool canAssign) {
+static void break_(Parser *parser, bool canAssign) {
   (void)canAssign;
-  PatchJump *jump = loopGotoJump("Can't use break outside of loop.");
+  PatchJump *jump = loopGotoJump(parser, "Can't use break outside of loop.");
   if (jump) {
-    jump->next = current->loopJumps->patchBreak;
-    current->loopJumps->patchBreak = jump;
+    jump->next = parser->compiler->loopJumps->patchBreak;
+    parser->compiler->loopJumps->patchBreak = jump;
   }
 }
 
 // parse a continue statement
-static void continue_(bool canAssign) {
+static void continue_(Parser *parser, bool canAssign) {
   (void)canAssign;
-  PatchJump *jump = loopGotoJump("Can't use continue outside of loop.");
+  PatchJump *jump = loopGotoJump(parser, "Can't use continue outside of loop.");
   if (jump) {
-    jump->next = current->loopJumps->patchContinue;
-    current->loopJumps->patchContinue = jump;
+    jump->next = parser->compiler->loopJumps->patchContinue;
+    parser->compiler->loopJumps->patchContinue = jump;
   }
 }
 
 // parse a super statement
-static void super_(bool canAssign) {
-  if (currentClass == NULL) {
-    error("Can't use 'super' outside of a class.");
-  } else if (!currentClass->hasSuperclass) {
-    error("Can't use 'super' in a class with no superclass.");
-  }
-
-  consume(TOKEN_DOT, "Expect '.' after 'super'.");
-  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
-
-  namedVariable(syntheticToken("this"), false);
-  if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
-    emitByte(argCount);
+static void super_(Parser *parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'super' outside of a class.");
+  } else if (!parser->currentClass->hasSuperclass) {
+    error(parser, "Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(parser, &parser->previous);
+
+  namedVariable(parser, syntheticToken("this"), false);
+  if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitBytes(parser, OP_SUPER_INVOKE, name);
+    emitByte(parser, argCount);
   } else {
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitBytes(parser, OP_GET_SUPER, name);
   }
 }
 
 // parse a this statement
-static void this_(bool canAssign) {
+static void this_(Parser *parser, bool canAssign) {
   (void)canAssign;
 
-  if (currentClass == NULL) {
-    error("Can't use 'this' outside of a class.");
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
     return;
   }
 
-  variable(false);
+  variable(parser, false);
 }
 
 // parse a grouping ie: (....)
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "EXPECT ')' after expression");
+static void grouping(Parser *parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "EXPECT ')' after expression");
 }
 
 // parse a unary, ie '!' or '-' in  '!true' or '-1'
-static void unary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void unary(Parser *parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
 
   // compile the operand
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(parser, PREC_UNARY);
 
   // Emit the operator instruction
   switch (operatorType) {
-  case TOKEN_BANG:  emitByte(OP_NOT); break;
-  case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+  case TOKEN_BANG:  emitByte(parser, OP_NOT); break;
+  case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
   default: return;
   }
 }
 
 // parse a binary expression such as 1 < 2 or 1 == 1
-static void binary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void binary(Parser *parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
   ParseRule *rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence +1));
+  parsePrecedence(parser, (Precedence)(rule->precedence +1));
 
   switch (operatorType) {
-  case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-  case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-  case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-  case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-  case TOKEN_LESS:          emitByte(OP_LESS); break;
-  case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-  case TOKEN_PLUS:          emitByte(OP_ADD); break;
-  case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-  case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-  case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+  case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;
+  case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+  case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+  case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+  case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+  case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+  case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+  case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+  case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+  case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
   default: return; // unreachable
   }
 }
 
 // call a function
-static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+static void call(Parser *parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
 }
 
 // subscript access property dict[...] or array[1]
-static void subscript(bool canAssign) {
-  Chunk *chunk = currentChunk();
+static void subscript(Parser *parser, bool canAssign) {
+  Chunk *chunk = currentChunk(parser);
   int getObjPos = chunk->count - 2;
-  expression();
+  expression(parser);
   int getExprPos = chunk->count - 2;
 
-  consume(TOKEN_RIGHT_BRACKET, "Expect ']'.");
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']'.");
   // FIXME finish special subscript operator
-  OpCode mutateCode = mutate(canAssign);
+  OpCode mutateCode = mutate(parser, canAssign);
   if (mutateCode != OP_NIL) {
-    Chunk *chunk = currentChunk();
-    emitBytes(chunk->code[getObjPos], chunk->code[getObjPos+1]);
-    emitBytes(chunk->code[getExprPos], chunk->code[getExprPos+1]);
-    emitByte(OP_GET_INDEXER);
+    Chunk *chunk = currentChunk(parser);
+    emitBytes(parser, chunk->code[getObjPos], chunk->code[getObjPos+1]);
+    emitBytes(parser, chunk->code[getExprPos], chunk->code[getExprPos+1]);
+    emitByte(parser, OP_GET_INDEXER);
     //emitByte(OP_GET_INDEXER);
-    expression();
-    emitByte(mutateCode);
-    emitByte(OP_SET_INDEXER);
-  } else if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitByte(OP_SET_INDEXER);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    emitByte(OP_GET_INDEXER);
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    expression(parser);
+    emitByte(parser, mutateCode);
+    emitByte(parser, OP_SET_INDEXER);
+  } else if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitByte(parser, OP_SET_INDEXER);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    emitByte(parser, OP_GET_INDEXER);
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
   } else {
-    emitByte(OP_GET_INDEXER);
+    emitByte(parser, OP_GET_INDEXER);
   }
 }
 
 // declare an array ie. = [ ... ]
-static void arrayDecl(bool canAssign) {
-  emitByte(OP_DEFINE_ARRAY);
-  while (parser.current.type != TOKEN_RIGHT_BRACKET) {
-    expression();
-    if (parser.current.type != TOKEN_RIGHT_BRACKET)
-      consume(TOKEN_COMMA, "Expect ',' between array items.");
-    emitByte(OP_ARRAY_PUSH);
+static void arrayDecl(Parser *parser, bool canAssign) {
+  emitByte(parser, OP_DEFINE_ARRAY);
+  while (parser->current.type != TOKEN_RIGHT_BRACKET) {
+    expression(parser);
+    if (parser->current.type != TOKEN_RIGHT_BRACKET)
+      consume(parser, TOKEN_COMMA, "Expect ',' between array items.");
+    emitByte(parser, OP_ARRAY_PUSH);
   }
 
-  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array declaration.");
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array declaration.");
 }
 
 // '.' accessor for classes and dicts
-static void dot(bool canAssign) {
-  consume(TOKEN_IDENTIFIER, "Expect property after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+static void dot(Parser *parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property after '.'.");
+  uint8_t name = identifierConstant(parser, &parser->previous);
 
-  OpCode mutateCode = mutate(canAssign);
+  OpCode mutateCode = mutate(parser, canAssign);
   if (mutateCode != OP_NIL) {
-    Chunk *chunk = currentChunk();
+    Chunk *chunk = currentChunk(parser);
     int getObjPos = chunk->count - 2;
-    emitByte(chunk->code[getObjPos]);
-    emitByte(chunk->code[getObjPos+1]);
-    emitBytes(OP_GET_PROPERTY, name);
-    expression();
-    emitByte(mutateCode);
-    emitBytes(OP_SET_PROPERTY, name);
-  } else if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(OP_SET_PROPERTY, name);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
-    emitByte(argCount);
+    emitByte(parser, chunk->code[getObjPos]);
+    emitByte(parser, chunk->code[getObjPos+1]);
+    emitBytes(parser, OP_GET_PROPERTY, name);
+    expression(parser);
+    emitByte(parser, mutateCode);
+    emitBytes(parser, OP_SET_PROPERTY, name);
+  } else if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitBytes(parser, OP_SET_PROPERTY, name);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_INVOKE, name);
+    emitByte(parser, argCount);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitBytes(parser, OP_GET_PROPERTY, name);
   }
 }
 
 // parse literal, ie: true, false, nil
-static void literal(bool canAssign) {
-  switch (parser.previous.type) {
-  case TOKEN_FALSE: emitByte(OP_FALSE); break;
-  case TOKEN_NIL:   emitByte(OP_NIL); break;
-  case TOKEN_TRUE:  emitByte(OP_TRUE); break;
+static void literal(Parser *parser, bool canAssign) {
+  switch (parser->previous.type) {
+  case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+  case TOKEN_NIL:   emitByte(parser, OP_NIL); break;
+  case TOKEN_TRUE:  emitByte(parser, OP_TRUE); break;
   default: return; // Unreachable
   }
 }
 
 // parse a dict
-static void dict(bool canAssign) {
-  emitByte(OP_DEFINE_DICT);
-  while (parser.current.type == TOKEN_IDENTIFIER) {
-    consume(TOKEN_IDENTIFIER, "Expect key.");
-    uint8_t constant = identifierConstant(&parser.previous);
-    consume(TOKEN_COLON, "Expect ':' after dict key.");
-    expression();
-    if (parser.current.type != TOKEN_RIGHT_BRACE)
-      consume(TOKEN_COMMA, "Expect ',' between dict fields.");
-    emitBytes(OP_DICT_FIELD, constant);
+static void dict(Parser *parser, bool canAssign) {
+  emitByte(parser, OP_DEFINE_DICT);
+  while (parser->current.type == TOKEN_IDENTIFIER) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect key.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
+    consume(parser, TOKEN_COLON, "Expect ':' after dict key.");
+    expression(parser);
+    if (parser->current.type != TOKEN_RIGHT_BRACE)
+      consume(parser, TOKEN_COMMA, "Expect ',' between dict fields.");
+    emitBytes(parser, OP_DICT_FIELD, constant);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after dict declaration.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after dict declaration.");
 }
 
 static ParseRule rules[] = {
@@ -1411,9 +1521,12 @@ static ParseRule* getRule(TokenType type) {
 }
 
 // initializes the compiler
-static void initCompiler(Compiler *compiler, Module *module, FunctionType type) {
-  assert(compiler != current && "Setting itself as enclosing compiler.");
-  compiler->enclosing = current;
+static void initCompiler(Parser *parser, Compiler *compiler,
+                         Module *module, FunctionType type)
+{
+  assert(compiler != parser->compiler &&
+         "Setting itself as enclosing compiler.");
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
   compiler->localCount = compiler->scopeDepth = 0;
@@ -1421,16 +1534,22 @@ static void initCompiler(Compiler *compiler, Module *module, FunctionType type)
   compiler->function->chunk.module = module;
   compiler->function->chunk.compiler = compiler;
   compiler->loopJumps = NULL;
-
-  current = compiler;
+  compiler->bodyStart = NULL;
+  compiler->bodyLine = 0;
+  compiler->upvalueNames = NULL;
+  compiler->inClass = compiler->hasSuperclass = false;
+  // unused locals must be zero, snapshot stops at first empty name
+  memset(compiler->locals, 0, sizeof(compiler->locals));
+
+  parser->compiler = compiler;
   if (type != TYPE_SCRIPT && type != TYPE_EVAL) {
-    current->function->name = copyString(
-                                parser.previous.start,
-                                parser.previous.length);
+    parser->compiler->function->name = copyString(
+                                parser->previous.start,
+                                parser->previous.length);
   }
 
   if (type != TYPE_EVAL) {
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION) {
@@ -1443,13 +1562,24 @@ static void initCompiler(Compiler *compiler, Module *module, FunctionType type)
   }
 }
 
-static void initParser(Parser *parser) {
+static void initParser(Parser *parser, const char *source, int line) {
+  initTokenStream(&parser->tokens, source, line);
   parser->hadError = parser->panicMode = false;
   parser->current.length = parser->current.line =
     parser->previous.length = parser->previous.line = 0;
   parser->current.start = parser->previous.start = '\0';
-  parser->current.type = parser->previous.type =
-    parser->prePrevious.type = TOKEN_EOF;
+  parser->current.type = parser->previous.type = TOKEN_EOF;
+  parser->compiler = NULL;
+  parser->currentClass = NULL;
+  parser->stats = NULL;
+  parser->checkOnly = false;
+  parser->enclosing = activeParser;
+  activeParser = parser;
+}
+
+// compile is done, its functions are no longer GC roots
+static void endParser(Parser *parser) {
+  activeParser = parser->enclosing;
 }
 
 // ---------------------------------------------
@@ -1457,57 +1587,98 @@ static void initParser(Parser *parser) {
 ObjFunction *compile(const char *source, Module *module,
                      FunctionType fnType)
 {
-  initScanner(source);
-  initParser(&parser);
+  Parser parser;
+  initParser(&parser, source, 1);
+  if (compileStatsEnabled && module != NULL)
+    parser.stats = &module->stats;
 
   Compiler *compiler = ALLOCATE(Compiler, 1);
-  initCompiler(compiler, module, fnType);
+  initCompiler(&parser, compiler, module, fnType);
 
-  advance();
-  while (!match(TOKEN_EOF))
-    declaration();
+  advance(&parser);
+  while (!match(&parser, TOKEN_EOF))
+    declaration(&parser);
 
-  ObjFunction *function = endCompiler();
-  current = NULL;
+  ObjFunction *function = endCompiler(&parser);
+  endParser(&parser);
   return parser.hadError ? NULL : function;
 }
 
 // create a compileEval
 ObjFunction *compileEvalExpr(const char *source, Chunk *parentChunk) {
-  // save state
-  scannerStashPush();
-  Parser oldParser;
-  memcpy(&oldParser, &parser, sizeof(parser));
-
-  Compiler *oldCurrent = current;
-  current = parentChunk->compiler;
-  initScanner(source);
-  initParser(&parser);
+  Parser parser;
+  initParser(&parser, source, 1);
+  parser.compiler = parentChunk->compiler;
 
   Compiler *compiler = ALLOCATE(Compiler, 1);
-  initCompiler(compiler, parentChunk->module, TYPE_EVAL);
-  ObjFunction *function = current->function;
+  initCompiler(&parser, compiler, parentChunk->module, TYPE_EVAL);
+  ObjFunction *function = parser.compiler->function;
 
-  advance();
-  while (!match(TOKEN_EOF))
-    expression();
+  advance(&parser);
+  while (!match(&parser, TOKEN_EOF))
+    expression(&parser);
 
   //functionUpvalues(compiler, function);
-  emitByte(OP_EVAL_EXIT);
+  emitByte(&parser, OP_EVAL_EXIT);
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError)
-    disassembleChunk(currentChunk(), "code");
+    disassembleChunk(currentChunk(&parser), "code");
 #endif
 
-  // restore state
-  current = oldCurrent;
-  scannerStashPop();
-  memcpy(&parser, &oldParser, sizeof(parser));
-
+  endParser(&parser);
   return function;
 }
 
+bool setLazyCompile(bool enabled) {
+  bool old = lazyCompile;
+  lazyCompile = enabled;
+  return old;
+}
+
+bool compileFunctionBody(ObjFunction *function) {
+  Compiler *compiler = function->chunk.compiler;
+  if (compiler == NULL || compiler->bodyStart == NULL) return true;
+
+  bool enabled = setGCenabled(false);
+  // body is added to a function that might be older
+  writeBarrierBefore(OBJ_CAST(function));
+  int localCount = compiler->localCount,
+      scopeDepth = compiler->scopeDepth;
+
+  uint64_t start = statsClock();
+  Parser parser;
+  initParser(&parser, compiler->bodyStart, compiler->bodyLine);
+  if (compileStatsEnabled && function->chunk.module != NULL)
+    parser.stats = &function->chunk.module->stats;
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.hasSuperclass = compiler->hasSuperclass;
+  parser.currentClass = compiler->inClass ? &classCompiler : NULL;
+  parser.compiler = compiler;
+
+  advance(&parser);
+  block(&parser);
+  endCompiler(&parser);
+  endParser(&parser);
+  bool compiled = !parser.hadError;
+
+  if (compiled) {
+    FREE_ARRAY(Token, compiler->upvalueNames, function->upvalueCount);
+    compiler->upvalueNames = NULL;
+    compiler->bodyStart = NULL;
+  } else {
+    // discard, errors gets reported again on next call
+    clearChunk(&function->chunk);
+    compiler->localCount = localCount;
+    compiler->scopeDepth = scopeDepth;
+  }
+
+  statsAddTime(parser.stats, PHASE_COMPILE, start);
+  setGCenabled(enabled);
+  return compiled;
+}
+
 Local *getUpvalueByIndex(ObjFunction **function, int *index) {
   Compiler *comp = (*function)->chunk.compiler;
   while (comp && !comp->upvalues[*index].isLocal) {
@@ -1537,10 +1708,13 @@ Local *getUpvalueFromName(ObjFunction **function,
 }
 
 void markCompilerRoots(ObjFlags flags) {
-  Compiler *compiler = current;
-  while (compiler != NULL) {
-    markObject(OBJ_CAST(compiler->function), flags);
-    compiler = compiler->enclosing;
+  for (Parser *parser = activeParser; parser != NULL;
+       parser = parser->enclosing)
+  {
+    Compiler *compiler = parser->compiler;
+    while (compiler != NULL) {
+      markObject(OBJ_SLOT(compiler->function), flags);
+      compiler = compiler->enclosing;
+    }
   }
-
 }
\ No newline at end of file
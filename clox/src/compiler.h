@@ -43,6 +43,12 @@ typedef struct Compiler {
   LoopJumps *loopJumps;
   int localCount,
       scopeDepth;
+  // lazy compile, set while body is only preparsed
+  const char *bodyStart;
+  int bodyLine;
+  Token *upvalueNames; // resolve upvalues by name, not via enclosing
+  bool inClass,
+       hasSuperclass;
 } Compiler;
 
 // compiles source, returns containing function
@@ -51,6 +57,14 @@ ObjFunction *compile(const char *source, Module *module,
 // create a compileEval
 ObjFunction *compileEvalExpr(const char *source, Chunk *parentChunk);
 
+// when enabled compile only checks function bodies, their code is
+// made on first call, returns previous state
+bool setLazyCompile(bool enabled);
+
+// compile body of a function that was only checked
+// returns false on compile error
+bool compileFunctionBody(ObjFunction *function);
+
 // looks up upvalue in parent function based on upvalue index
 // function get set to the function containing upvalueIndex as a local
 // index is the upvalue index in function, gets set to local index in containg function
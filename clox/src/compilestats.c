@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "compilestats.h"
+
+bool compileStatsEnabled = false;
+
+static double toMs(uint64_t ns) {
+  return ns / 1e6;
+}
+
+// ------------------------------------------------------
+
+uint64_t statsClock() {
+  if (!compileStatsEnabled) return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void statsAddTime(CompileStats *stats, CompilePhase phase, uint64_t start) {
+  if (stats == NULL) return;
+  stats->phaseNs[phase] += statsClock() - start;
+}
+
+void printCompileStats(const char *name, CompileStats *stats) {
+  uint64_t *ns = stats->phaseNs;
+  fprintf(stderr,
+          "== compile stats %s ==\n"
+          "  read       %10.3f ms\n"
+          "  scan       %10.3f ms  %d tokens\n"
+          "  constants  %10.3f ms  %d calls\n"
+          "  compile    %10.3f ms  includes scan and constants\n"
+          "  run        %10.3f ms  includes imported modules\n"
+          "  emitted    %d bytes, %d constants in %d functions\n",
+          name,
+          toMs(ns[PHASE_READ]),
+          toMs(ns[PHASE_SCAN]), stats->tokens,
+          toMs(ns[PHASE_CONSTANTS]), stats->constantCalls,
+          toMs(ns[PHASE_COMPILE]),
+          toMs(ns[PHASE_RUN]),
+          stats->bytecodeBytes, stats->constants, stats->functions);
+}
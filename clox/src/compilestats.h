@@ -0,0 +1,39 @@
+#ifndef LOX_COMPILESTATS_H
+#define LOX_COMPILESTATS_H
+
+#include "common.h"
+
+// Timers and counters for the phases a module goes through on load,
+// collected per module when --compile-stats is given.
+
+typedef enum {
+  PHASE_READ,      // reading the source file
+  PHASE_SCAN,      // scanning tokens, part of PHASE_COMPILE
+  PHASE_CONSTANTS, // addConstant and identifierConstant, part of PHASE_COMPILE
+  PHASE_COMPILE,   // compiling, including lazy compiled function bodies
+  PHASE_RUN,       // running the module, includes modules it imports
+  PHASE_COUNT
+} CompilePhase;
+
+typedef struct CompileStats {
+  uint64_t phaseNs[PHASE_COUNT];
+  int tokens,
+      bytecodeBytes,
+      constants,
+      functions,
+      constantCalls;
+} CompileStats;
+
+// set by --compile-stats
+extern bool compileStatsEnabled;
+
+// monotonic clock in nanoseconds, 0 when stats are disabled
+uint64_t statsClock();
+
+// add time since start to phase, does nothing when stats is NULL
+void statsAddTime(CompileStats *stats, CompilePhase phase, uint64_t start);
+
+// print stats of module name to stderr
+void printCompileStats(const char *name, CompileStats *stats);
+
+#endif // LOX_COMPILESTATS_H
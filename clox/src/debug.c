@@ -88,11 +88,11 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
 
   if (offset > 0 &&
-      chunk->lines[offset] == chunk->lines[offset-1])
+      getChunkLine(chunk, offset) == getChunkLine(chunk, offset-1))
   {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", getChunkLine(chunk, offset));
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -123,8 +123,8 @@ static void processEvents(OpCode opCode) {
 
 static void setCurrentFrame(int stackLevel) {
   frame = &vm.frames[vm.frameCount -1 - stackLevel];
-  line = frame->closure->function->chunk.lines[
-    (int)(frame->ip - frame->closure->function->chunk.code)];
+  line = getChunkLine(&frame->closure->function->chunk,
+    (int)(frame->ip - frame->closure->function->chunk.code));
   listLineNr = -1;
 }
 
@@ -676,8 +676,8 @@ static void backtrace_() {
           frm == frame ? "*" : " ",
           fnName,
           frm->closure->function->chunk.module->path->chars,
-          frm->closure->function->chunk.lines[
-            (int)(frm->ip - frm->closure->function->chunk.code)]
+          getChunkLine(&frm->closure->function->chunk,
+            (int)(frm->ip - frm->closure->function->chunk.code))
     );
   }
 }
@@ -1335,7 +1335,7 @@ void resumeDebugger() {
 void markDebuggerRoots(ObjFlags flags) {
   Breakpoint *bp = debugger.breakpoints;
   while (bp != NULL) {
-    markObject(OBJ_CAST(bp->evalCondition), flags);
+    markObject(OBJ_SLOT(bp->evalCondition), flags);
     bp = bp->next;
   }
 }
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapprofile.h"
+#include "memory.h"
+#include "vm.h"
+
+#define DEFAULT_RATE (512 * 1024)
+#define STACK_CHARS  4096
+
+typedef struct Site {
+  char *stack;
+  uint32_t hash;
+  size_t totalBytes,
+         liveBytes;
+} Site;
+
+typedef struct Sample {
+  Obj *object;
+  int site;
+  size_t bytes; // allocated since the sample before
+} Sample;
+
+bool heapProfileEnabled = false;
+static const char *profilePath = NULL;
+static size_t rate = DEFAULT_RATE,
+              sinceSample = 0;
+
+static Site *sites = NULL;
+static int siteCount = 0,
+           siteCapacity = 0;
+// hash index into sites, slot holds site index +1
+static int *siteIndex = NULL;
+static int indexCapacity = 0;
+
+static Sample *samples = NULL;
+static int sampleCount = 0,
+           sampleCapacity = 0;
+
+static void *growOrExit(void *pointer, size_t size) {
+  pointer = realloc(pointer, size);
+  if (pointer == NULL) {
+    fprintf(stderr, "Out of memory in heap profiler.\n");
+    exit(1);
+  }
+  return pointer;
+}
+
+static uint32_t hashStack(const char *stack, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; ++i) {
+    hash ^= (uint8_t)stack[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// root frame first, "fn:line;fn:line"
+static int frameStack(char *stack, int size) {
+  if (vm.frameCount == 0)
+    return snprintf(stack, size, "(no frame)");
+
+  int length = 0;
+  for (int i = 0; i < vm.frameCount && length < size; ++i) {
+    CallFrame *frame = &vm.frames[i];
+    ObjFunction *function = frame->closure->function;
+    int pos = (int)(frame->ip - function->chunk.code) -1;
+    length += snprintf(stack + length, size - length, "%s%s:%d",
+                       i > 0 ? ";" : "",
+                       function->name != NULL ?
+                         function->name->chars : "script",
+                       getChunkLine(&function->chunk, pos > 0 ? pos : 0));
+  }
+  return length < size ? length : size -1;
+}
+
+static void indexSite(int site) {
+  uint32_t idx = sites[site].hash & (indexCapacity -1);
+  while (siteIndex[idx] != 0)
+    idx = (idx +1) & (indexCapacity -1);
+  siteIndex[idx] = site +1;
+}
+
+static int findSite(const char *stack, int length) {
+  if (siteCount +1 > indexCapacity / 2) {
+    indexCapacity = indexCapacity < 64 ? 64 : indexCapacity * 2;
+    siteIndex = growOrExit(siteIndex, sizeof(int) * indexCapacity);
+    memset(siteIndex, 0, sizeof(int) * indexCapacity);
+    for (int i = 0; i < siteCount; ++i)
+      indexSite(i);
+  }
+
+  uint32_t hash = hashStack(stack, length);
+  for (uint32_t idx = hash & (indexCapacity -1);;
+       idx = (idx +1) & (indexCapacity -1))
+  {
+    int slot = siteIndex[idx];
+    if (slot == 0) break;
+    Site *site = &sites[slot -1];
+    if (site->hash == hash && strcmp(site->stack, stack) == 0)
+      return slot -1;
+  }
+
+  if (siteCapacity < siteCount +1) {
+    siteCapacity = siteCapacity < 8 ? 8 : siteCapacity * 2;
+    sites = growOrExit(sites, sizeof(Site) * siteCapacity);
+  }
+  Site *site = &sites[siteCount];
+  site->stack = growOrExit(NULL, length +1);
+  memcpy(site->stack, stack, length +1);
+  site->hash = hash;
+  site->totalBytes = site->liveBytes = 0;
+  indexSite(siteCount);
+  return siteCount++;
+}
+
+static void writeSites(const char *path, bool live) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write heap profile \"%s\".\n", path);
+    return;
+  }
+  for (int i = 0; i < siteCount; ++i) {
+    size_t bytes = live ? sites[i].liveBytes : sites[i].totalBytes;
+    if (bytes > 0)
+      fprintf(file, "%s %zu\n", sites[i].stack, bytes);
+  }
+  fclose(file);
+}
+
+// ------------------------------------------------------------
+
+void startHeapProfile(const char *path) {
+  profilePath = path;
+  heapProfileEnabled = true;
+}
+
+void setHeapProfileRate(size_t bytes) {
+  rate = bytes > 0 ? bytes : DEFAULT_RATE;
+}
+
+void heapProfileAlloc(Obj *object, size_t size) {
+  sinceSample += size;
+  if (sinceSample < rate) return;
+
+  char stack[STACK_CHARS];
+  int site = findSite(stack, frameStack(stack, sizeof(stack)));
+  sites[site].totalBytes += sinceSample;
+  sites[site].liveBytes += sinceSample;
+
+  if (sampleCapacity < sampleCount +1) {
+    sampleCapacity = sampleCapacity < 8 ? 8 : sampleCapacity * 2;
+    samples = growOrExit(samples, sizeof(Sample) * sampleCapacity);
+  }
+  samples[sampleCount++] = (Sample){object, site, sinceSample};
+  sinceSample = 0;
+}
+
+void sweepHeapProfile(ObjFlags flags) {
+  for (int i = 0; i < sampleCount;) {
+    Sample *sample = &samples[i];
+    Obj *object = sample->object;
+    bool older = object->flags & GC_IS_OLDER;
+    if (flags == GC_IS_MARKED && !older &&
+        (object->flags & GC_FORWARDED))
+    {
+      sample->object = object->next;
+    } else if ((flags == GC_IS_MARKED && !older) ||
+               (flags == GC_IS_MARKED_OLDER && older &&
+                !isMarked(object, flags)))
+    {
+      sites[sample->site].liveBytes -= sample->bytes;
+      *sample = samples[--sampleCount];
+      continue;
+    }
+    ++i;
+  }
+}
+
+void forwardHeapProfile() {
+  for (int i = 0; i < sampleCount; ++i) {
+    if (samples[i].object->flags & GC_FORWARDED)
+      samples[i].object = samples[i].object->next;
+  }
+}
+
+void heapProfileForgetObjects() {
+  sampleCount = 0;
+}
+
+void writeHeapProfile() {
+  if (!heapProfileEnabled) return;
+
+  writeSites(profilePath, false);
+  size_t length = strlen(profilePath);
+  char *livePath = growOrExit(NULL, length + sizeof(".live"));
+  memcpy(livePath, profilePath, length);
+  memcpy(livePath + length, ".live", sizeof(".live"));
+  writeSites(livePath, true);
+  free(livePath);
+}
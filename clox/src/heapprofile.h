@@ -0,0 +1,39 @@
+#ifndef LOX_HEAPPROFILE_H
+#define LOX_HEAPPROFILE_H
+
+#include "common.h"
+#include "object.h"
+
+// Sampling heap profiler, enabled by --heap-profile. Each time another
+// rate bytes of objects are allocated, the object being allocated is
+// sampled along with the Lox call stack that allocates it. Sites are
+// written at exit as collapsed stacks, "fn:line;fn:line bytes", which
+// flame graph tools read. One file has all bytes allocated by a site,
+// another with .live appended the bytes still live after the last GC.
+
+// set by --heap-profile
+extern bool heapProfileEnabled;
+
+// start sampling, the profile is written to path at exit
+void startHeapProfile(const char *path);
+
+// bytes allocated between samples
+void setHeapProfileRate(size_t bytes);
+
+// count size bytes of object allocated, call when heapProfileEnabled
+void heapProfileAlloc(Obj *object, size_t size);
+
+// after marking with flags, drop samples of objects that died and
+// follow infants moved to older
+void sweepHeapProfile(ObjFlags flags);
+
+// follow objects moved by a compacting older collect
+void forwardHeapProfile();
+
+// all objects are freed, samples are dropped and live bytes kept
+void heapProfileForgetObjects();
+
+// write the profile to the files given to startHeapProfile
+void writeHeapProfile();
+
+#endif // LOX_HEAPPROFILE_H
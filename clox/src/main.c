@@ -15,20 +15,97 @@
 #include "module.h"
 #include "debugger.h"
 #include "memory.h"
+#include "snapshot.h"
+#include "compiler.h"
+#include "prefetch.h"
+#include "compilestats.h"
+#include "heapprofile.h"
+
+static const char *snapshotOut = NULL;
+static int prefetchThreads = 2;
+
+// long only options
+enum {
+  OPT_COMPILE_STATS = 256,
+  OPT_GC_PAUSE,
+  OPT_GC_CONCURRENT,
+  OPT_GC_THREADS,
+  OPT_GC_STRING_CAP,
+  OPT_GC_COMPACT,
+  OPT_HEAP_PROFILE,
+  OPT_HEAP_PROFILE_RATE,
+  OPT_GC_CONFIG
+};
+
+static const struct option longOptions[] = {
+  {"compile-stats", no_argument, NULL, OPT_COMPILE_STATS},
+  {"gc-pause",      required_argument, NULL, OPT_GC_PAUSE},
+  {"gc-concurrent", no_argument, NULL, OPT_GC_CONCURRENT},
+  {"gc-threads",    required_argument, NULL, OPT_GC_THREADS},
+  {"gc-string-cap", required_argument, NULL, OPT_GC_STRING_CAP},
+  {"gc-compact",    no_argument, NULL, OPT_GC_COMPACT},
+  {"gc-config",     required_argument, NULL, OPT_GC_CONFIG},
+  {"heap-profile",  required_argument, NULL, OPT_HEAP_PROFILE},
+  {"heap-profile-rate", required_argument, NULL, OPT_HEAP_PROFILE_RATE},
+  {"help",          no_argument, NULL, 'h'},
+  {"version",       no_argument, NULL, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+static void dumpGCStats() {
+  printGCStats(stderr);
+}
 
 static void printUsage() {
   printf("Lox programming language implementation.\n"
-         "usage: clox -dDvh file1.lox [file2.lox file3.lox ... ]\n"
+         "usage: clox -dDjLrwvh file1.lox [file2.lox file3.lox ... ]\n"
          "clox                   open in interactive (REPL) mode.\n\n"
          "clox  -D debugCommandsFile scriptfile.lox\n\n"
+         "clox  -w snapshotFile  Write compiled heap to snapshot after run.\n\n"
+         "clox  -r snapshotFile  Restore compiled heap from snapshot, skips\n"
+         "                   reading and compiling unchanged modules. VM\n"
+         "                   setup still runs, natives are rebound by name\n"
+         "                   and module top level code runs again.\n\n"
+         "clox  -j threads   Threads reading imported files ahead, 0 disables.\n\n"
+         "clox  -L           Make the code of a function body on first call,\n"
+         "                   bodies are still checked when loaded, so errors\n"
+         "                   are reported and exit as without -L.\n\n"
+         "clox  --compile-stats  Print time spent reading, scanning, compiling\n"
+         "                   and running each module to stderr at exit.\n\n"
+         "clox  --gc-pause=us  Mark the older generation incrementally,\n"
+         "                   adding at most us microseconds to each collect.\n\n"
+         "clox  --gc-concurrent  Mark the older generation on a thread of its own.\n\n"
+         "clox  --gc-threads=n  Threads marking a full older collect together.\n\n"
+         "clox  --gc-string-cap=n  Collect the older generation when more than\n"
+         "                   n strings are interned.\n\n"
+         "clox  --gc-compact  Move live older objects together when the older\n"
+         "                   generation is collected, returning emptied\n"
+         "                   memory to the system.\n\n"
+         "clox  --gc-config=key=value,...  Set nursery, infant-min,\n"
+         "                   older-min and max-heap in bytes (K, M or G\n"
+         "                   suffix), grow factor and cpu-target, the share\n"
+         "                   of time in GC pauses the heap adapts to.\n\n"
+         "clox  --heap-profile=file  Sample allocations by Lox call stack,\n"
+         "                   writes collapsed stacks of all bytes to file\n"
+         "                   and of live bytes to file.live at exit.\n\n"
+         "clox  --heap-profile-rate=bytes  Bytes allocated between samples.\n\n"
+         "Set CLOX_GC_STATS to print GC counters to stderr at exit,\n"
+         "CLOX_GC to settings as for --gc-config.\n\n"
          "clox  -v           Show version.\n\n"
          "clox  -h           Show help");
 }
 
 static int runFile(const char* path) {
-  Module *module = createModule("__main__", path);
+  // might already be restored from a snapshot
+  Module *module = getModule(path);
+  if (module == NULL)
+    module = createModule("__main__", path);
   InterpretResult result = loadModule(module);
 
+  if (result == INTERPRET_OK && snapshotOut != NULL)
+    writeSnapshot(snapshotOut);
+
+  printAllCompileStats();
   delModuleVM(module);
 
   switch (result) {
@@ -105,13 +182,20 @@ int main(int argc, char * const argv[]) {
   DebugStates initDbgState = DBG_RUN;
   const char *initDebuggerCmds = NULL;
   loxInit(argc, argv);
+  if (getenv("CLOX_GC_STATS") != NULL)
+    atexit(dumpGCStats);
+  if (getenv("CLOX_GC") != NULL && !parseGCConfig(getenv("CLOX_GC")))
+    return 64;
 
   if (argc == 1) {
     repl();
   } else {
     int opt = 1; char *dbgCmdsFile = NULL;
+    const char *snapshotIn = NULL;
 
-    while ((opt = getopt(argc, argv, "dD:hv")) != -1) {
+    while ((opt = getopt_long(argc, argv, "dD:j:Lr:w:hv",
+                              longOptions, NULL)) != -1)
+    {
       switch (opt) {
       case 'd':
         initDbgState = DBG_HALT;
@@ -127,6 +211,48 @@ int main(int argc, char * const argv[]) {
         initDebuggerCmds = readFile(dbgCmdsFile);
         setInitCommands(initDebuggerCmds);
         break;
+      case 'j':
+        prefetchThreads = atoi(optarg);
+        break;
+      case OPT_COMPILE_STATS:
+        compileStatsEnabled = true;
+        break;
+      case OPT_GC_PAUSE:
+        setGCPauseTarget(atoi(optarg));
+        break;
+      case OPT_GC_CONCURRENT:
+        setGCConcurrent(true);
+        break;
+      case OPT_GC_THREADS:
+        setGCThreads(atoi(optarg));
+        break;
+      case OPT_GC_STRING_CAP:
+        setGCStringCap(atoi(optarg));
+        break;
+      case OPT_GC_COMPACT:
+        setGCCompact(true);
+        break;
+      case OPT_GC_CONFIG:
+        if (!parseGCConfig(optarg))
+          return 64;
+        break;
+      case OPT_HEAP_PROFILE:
+        if (!heapProfileEnabled)
+          atexit(writeHeapProfile);
+        startHeapProfile(optarg);
+        break;
+      case OPT_HEAP_PROFILE_RATE:
+        setHeapProfileRate((size_t)atol(optarg));
+        break;
+      case 'L':
+        setLazyCompile(true);
+        break;
+      case 'r':
+        snapshotIn = optarg;
+        break;
+      case 'w':
+        snapshotOut = optarg;
+        break;
       case 'h':
         printUsage();
         return 0;
@@ -138,8 +264,11 @@ int main(int argc, char * const argv[]) {
       }
     }
 
+    initPrefetch(prefetchThreads);
     for (; optind < argc; optind++) {
       initVM();
+      if (snapshotIn != NULL)
+        restoreSnapshot(snapshotIn);
       setDebuggerState(initDbgState);
       if (!runFile(argv[optind]))
         exit(70);
@@ -147,6 +276,7 @@ int main(int argc, char * const argv[]) {
 
   }
 
+  freePrefetch();
   freeVM();
   if (initDebuggerCmds != NULL)
     FREE_ARRAY(char, (char*)initDebuggerCmds, strlen(initDebuggerCmds));
@@ -1,9 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
+#include "pool.h"
+#include "heapprofile.h"
 
 #ifdef DEBUG_LOG_GC
 # include <stdio.h>
@@ -16,13 +22,130 @@
 # endif
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// under ASan each collect gets a new nursery, a stale pointer to
+// a moved object is then reported as use after free
+#if defined(__SANITIZE_ADDRESS__)
+# define NURSERY_FRESH
+#endif
+
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+// gray objects traced between looking at the clock
+#define MARK_SLICE_CHECK 64
+// bytes traced per byte promoted in a slice at least
+#define MARK_SLICE_WORK  8
+// limits of the adaptive controller, see tuneHeap
+#define GROW_FACTOR_MIN    1.25
+#define GROW_FACTOR_MAX    8.0
+#define NURSERY_SCALE_MAX  32
+#define SURVIVAL_HIGH      0.1
+// unswept objects looked at per older allocation and per infant collect
+#define SWEEP_ALLOC_STEP  16
+#define SWEEP_INFANT_STEP 4096
 
 // --------------------------------------------------------------
 static void markArray(ValueArray* array, ObjFlags flags);
-static bool disableGC = false;
+static bool sweepSome(int count);
+static void finishSweep();
+static bool disableGC = false,
+            allocateOlder = false,
+            evacuating = false, // infant collect in progress
+            compactOlder = false,
+            compacting = false; // references follow moved objects
+static int pauseTargetUs = 0,
+           stringCap = 0,
+           stringsNextGC = 0;
+static bool olderRequested = false; // by the string cap
+static size_t slicePromoted = 0; // stats.bytesPromoted at last slice
+static GCStats stats;
+static GCConfig config = {
+  NURSERY_SIZE, INFANT_GC_MIN, OLDER_GC_MIN, 0, GC_HEAP_GROW_FACTOR, 0
+};
 
-static void freeObject(Obj *object) {
+// tuned by the adaptive controller, start out as configured
+static size_t nurserySize = NURSERY_SIZE;
+static double growFactor = GC_HEAP_GROW_FACTOR,
+              survivalRate = 0; // of infant bytes, moving average
+static uint64_t cycleStartUs = 0,
+                cyclePauseUs = 0;
+
+// with concurrent marking a thread traces gray objects, the
+// interpreter takes markLock for infant collects and barrier slow paths.
+// The thread only changes flags of objects not yet black, outside of
+// markLock the interpreter only changes flags of black or new objects
+static bool concurrentMark = false,
+            markThreadRunning = false,
+            markThreadStop = false;
+static int markLockWaiters = 0;
+static pthread_t markThread;
+static pthread_mutex_t markLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markCond = PTHREAD_COND_INITIALIZER;
+
+// parallel marking gives each worker a deque of gray objects, a
+// worker out of work steals half the deque of another worker
+typedef struct MarkWorker {
+  int index;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  ObjStack gray;
+} MarkWorker;
+
+static MarkWorker *markWorkers = NULL;
+static int markWorkerCount = 1, // interpreter thread included
+           markWorkersStarted = 0,
+           markWorkersIdle = 0,
+           markWorkersDone = 0;
+static unsigned markEpoch = 0;
+static bool markWorkersStop = false;
+static pthread_mutex_t workersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workersStart = PTHREAD_COND_INITIALIZER,
+                      workersDone = PTHREAD_COND_INITIALIZER;
+static __thread MarkWorker *currentWorker = NULL;
+
+// older objects not yet swept since the last older marking, they keep
+// their mark bits until swept. Those in pool pages are found from the
+// page bitmaps by sweepCursor, so live ones are never written to. The
+// others are on the unswept list, dead ones are unlinked in place and
+// sweepLink is the link looked at next. Objects created meanwhile are
+// black, see allocateOlderObj, or go on vm.olderObjects
+static PoolCursor sweepCursor;
+static Obj *unswept = NULL,
+           **sweepLink = NULL; // NULL when not sweeping
+
+// infant objects are bumped from here, an infant collect copies
+// the survivors to older and starts over from the beginning
+static char *nursery = NULL,
+            *nurseryTop = NULL,
+            *nurseryEnd = NULL;
+
+static bool inNursery(Obj *object) {
+  return (char*)object >= nursery && (char*)object < nurseryTop;
+}
+
+static size_t objectSize(Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD:  return sizeof(ObjBoundMethod);
+  case OBJ_CLASS:         return sizeof(ObjClass);
+  case OBJ_ARRAY:         return sizeof(ObjArray);
+  case OBJ_DICT:          return sizeof(ObjDict);
+  case OBJ_CLOSURE:       return sizeof(ObjClosure);
+  case OBJ_FUNCTION:      return sizeof(ObjFunction);
+  case OBJ_INSTANCE:      return sizeof(ObjInstance);
+  case OBJ_NATIVE_FN:     return sizeof(ObjNativeFn);
+  case OBJ_NATIVE_PROP:   return sizeof(ObjNativeProp);
+  case OBJ_NATIVE_METHOD: return sizeof(ObjNativeMethod);
+  case OBJ_PROTOTYPE:     return sizeof(ObjPrototype);
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString*)object)->length +1;
+  case OBJ_UPVALUE:       return sizeof(ObjUpvalue);
+  case OBJ_MODULE:        return sizeof(ObjModule);
+  case OBJ_REFERENCE:     return sizeof(ObjReference);
+  case OBJ_ROPE:          return sizeof(ObjRope);
+  }
+  return 0;
+}
+
+// free memory owned by object, not the object itself
+static void freeObjectContents(Obj *object) {
 #if DEBUG_LOG_GC_FREE
   printf("%p free type %s\n", (void*)object, typeOfObject(object));
   if (object->type == OBJ_STRING)
@@ -30,64 +153,199 @@ static void freeObject(Obj *object) {
 #endif
 
   switch (object->type) {
-  case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object); break;
-  case OBJ_CLASS: {
-    ObjClass *klass = (ObjClass*)object;
-    freeTable(&klass->methods);
-    FREE(ObjClass, klass);
-  } break;
-  case OBJ_ARRAY: {
-    ObjArray *array = (ObjArray*)object;
-    freeValueArray(&array->arr);
-  } break;
-  case OBJ_DICT: {
-    ObjDict *dict = (ObjDict*)object;
-    freeTable(&dict->fields);
-    FREE(ObjDict, dict);
-  } break;
+  case OBJ_CLASS:
+    freeTable(&((ObjClass*)object)->methods); break;
+  case OBJ_ARRAY:
+    freeValueArray(&((ObjArray*)object)->arr); break;
+  case OBJ_DICT:
+    freeTable(&((ObjDict*)object)->fields); break;
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure*)object;
     FREE_ARRAY(ObjUpvalue*, closure->upvalues,
               closure->upvalueCount);
-    FREE(ObjClosure, object);
-  } break;
-  case OBJ_FUNCTION: {
-    ObjFunction *function = (ObjFunction*)object;
-    freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
   } break;
-  case OBJ_INSTANCE: {
-    ObjInstance *instance = (ObjInstance*)object;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, object);
-  } break;
-  case OBJ_NATIVE_FN:
-    FREE(ObjNativeFn, object); break;
-  case OBJ_NATIVE_PROP:
-    FREE(ObjNativeProp, object); break;
-  case OBJ_NATIVE_METHOD:
-    FREE(ObjNativeMethod, object); break;
+  case OBJ_FUNCTION:
+    freeChunk(&((ObjFunction*)object)->chunk); break;
+  case OBJ_INSTANCE:
+    freeTable(&((ObjInstance*)object)->fields); break;
   case OBJ_PROTOTYPE: {
     ObjPrototype *prot = (ObjPrototype*)object;
     freeTable(&prot->methodsNative);
     freeTable(&prot->propsNative);
-    FREE(ObjPrototype, prot);
-  } break;
-  case OBJ_STRING: {
-    ObjString *string = (ObjString*)object;
-    FREE_ARRAY(char, string->chars, string->length +1);
-    FREE(ObjString, object);
   } break;
-  case OBJ_UPVALUE:
-    FREE(ObjUpvalue, object); break;
-  case OBJ_MODULE:
-    FREE(ObjModule, object); break;
-  case OBJ_REFERENCE:
-    FREE(ObjReference, object); break;
+  case OBJ_STRING: case OBJ_BOUND_METHOD: case OBJ_NATIVE_FN:
+  case OBJ_NATIVE_PROP: case OBJ_NATIVE_METHOD:
+  case OBJ_UPVALUE: case OBJ_MODULE: case OBJ_REFERENCE:
+  case OBJ_ROPE:
+    break; // owns nothing
   }
 }
 
+static void freeObject(Obj *object) {
+  freeObjectContents(object);
+  freeObj(object, objectSize(object));
+}
+
+static void pushStack(ObjStack *stack, Obj *object) {
+  if (stack->capacity < stack->count +1) {
+    stack->capacity = GROW_CAPACITY(stack->capacity);
+    stack->objects = (Obj**)realloc(stack->objects,
+                            sizeof(Obj*) * stack->capacity);
+    if (stack->objects == NULL) {
+      fprintf(stderr, "Failed to allocate working memory during GC run.");
+      exit(1);
+    }
+  }
+
+  stack->objects[stack->count++] = object;
+}
+
+static void freeStack(ObjStack *stack) {
+  free(stack->objects);
+  stack->objects = NULL;
+  stack->count = stack->capacity = 0;
+}
+
+static uint64_t clockUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void lockMarking() {
+  if (!concurrentMark) return;
+  __atomic_add_fetch(&markLockWaiters, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&markLock);
+  __atomic_sub_fetch(&markLockWaiters, 1, __ATOMIC_RELAXED);
+}
+
+static void unlockMarking() {
+  if (concurrentMark)
+    pthread_mutex_unlock(&markLock);
+}
+
+// older mark state of objects in pool pages is kept in the page
+// bitmaps so marking leaves the pages untouched, larger objects keep
+// it in their flags
+static bool inPage(Obj *object) {
+  return __atomic_load_n(&object->flags, __ATOMIC_RELAXED) & GC_IN_PAGE;
+}
+
+static bool testOlderBit(Obj *object, PoolBitmap bitmap, ObjFlags flag) {
+  if (inPage(object))
+    return poolTestBit(object, bitmap);
+  return __atomic_load_n(&object->flags, __ATOMIC_ACQUIRE) & flag;
+}
+
+// returns whether the bit was set already
+static bool setOlderBit(Obj *object, PoolBitmap bitmap, ObjFlags flag) {
+  if (inPage(object))
+    return poolSetBit(object, bitmap);
+  return __atomic_fetch_or(&object->flags, flag, __ATOMIC_ACQ_REL) & flag;
+}
+
+// objects created while older marking is in progress are black, what
+// they point to was either reachable when marking began or is new too
+static void markNewOlder(Obj *object) {
+  if (vm.gcMarking) {
+    setOlderBit(object, POOL_MARK_BITS, GC_IS_MARKED_OLDER);
+    setOlderBit(object, POOL_SCAN_BITS, GC_SCANNED);
+  }
+}
+
+static void rememberObject(Obj *object) {
+  if ((object->flags & (GC_IS_OLDER | GC_REMEMBERED)) != GC_IS_OLDER)
+    return;
+  object->flags |= GC_REMEMBERED;
+  pushStack(&vm.remembered, object);
+}
+
+static Obj *allocateOlderObj(size_t size) {
+  // pay for the sweep as the older generation grows
+  sweepSome(SWEEP_ALLOC_STEP);
+  Obj *object = (Obj*)poolAlloc(size);
+  object->next = NULL;
+  if (poolInPage(size)) {
+    // objects in pages are found from the page bitmaps
+    object->flags = GC_IS_OLDER | GC_IN_PAGE;
+    if (sweepLink != NULL)
+      poolSetBit(object, POOL_MARK_BITS);
+  } else {
+    object->flags = GC_IS_OLDER;
+    object->next = vm.olderObjects;
+    vm.olderObjects = object;
+  }
+  vm.olderBytesAllocated += size;
+  return object;
+}
+
+// pointers into the object itself, or to it from what it owns
+static void movePointersInto(Obj *object, Obj *copy) {
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue*)copy;
+    if (upvalue->location == &((ObjUpvalue*)object)->closed)
+      upvalue->location = &upvalue->closed;
+  } else if (object->type == OBJ_FUNCTION) {
+    Compiler *compiler = ((ObjFunction*)copy)->chunk.compiler;
+    if (compiler != NULL && compiler->function == (ObjFunction*)object)
+      compiler->function = (ObjFunction*)copy;
+  }
+}
+
+// copy a surviving nursery object to older, the copy is pushed on the
+// scan stack so its fields get evacuated in turn, a Cheney scan
+static Obj *evacuate(Obj *object) {
+  size_t size = objectSize(object);
+  Obj *copy = allocateOlderObj(size),
+      *next = copy->next;
+  ObjFlags placed = copy->flags;
+  memcpy(copy, object, size);
+  copy->flags |= placed;
+  stats.bytesPromoted += size;
+  copy->next = next;
+  movePointersInto(object, copy);
+
+#if DEBUG_LOG_GC_MARK
+  printf("%p evacuate to %p %s\n", (void*)object, (void*)copy,
+         typeOfObject(copy));
+#endif
+
+  object->flags |= GC_FORWARDED;
+  object->next = copy;
+  pushStack(&vm.scan, copy);
+  markNewOlder(copy);
+  return copy;
+}
+
+// free what the dead nursery objects own and empty the nursery,
+// the survivors have all been copied out
+static void resetNursery() {
+  for (char *pos = nursery; pos < nurseryTop;) {
+    Obj *object = (Obj*)pos;
+    size_t size = NURSERY_ALIGN(objectSize(object));
+    pos += size;
+    if (!(object->flags & GC_FORWARDED)) {
+      freeObjectContents(object);
+      stats.bytesFreed += size;
+    }
+  }
+
+  size_t used = nurseryTop - nursery;
+  vm.infantBytesAllocated -= used < vm.infantBytesAllocated ?
+                               used : vm.infantBytesAllocated;
+#ifdef NURSERY_FRESH
+  free(nursery);
+  nursery = nurseryTop = nurseryEnd = NULL;
+#else
+  // resized by the adaptive controller
+  if ((size_t)(nurseryEnd - nursery) != nurserySize) {
+    free(nursery);
+    nursery = nurseryTop = nurseryEnd = NULL;
+  } else
+    nurseryTop = nursery;
+#endif
+}
+
 // for the GC
 static void blackenObject(Obj *object, ObjFlags flags) {
 #if DEBUG_LOG_GC_MARK
@@ -98,8 +356,8 @@ static void blackenObject(Obj *object, ObjFlags flags) {
   switch (object->type) {
   case OBJ_BOUND_METHOD: {
     ObjBoundMethod *bound = (ObjBoundMethod*)object;
-    markValue(bound->reciever, flags);
-    markObject((Obj*)bound->methods, flags);
+    markValue(&bound->reciever, flags);
+    markObject(OBJ_SLOT(bound->methods), flags);
   } break;
   case OBJ_ARRAY: {
     ObjArray *array = (ObjArray*)object;
@@ -111,39 +369,62 @@ static void blackenObject(Obj *object, ObjFlags flags) {
   } break;
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass*)object;
-    markObject(OBJ_CAST(klass->name), flags);
+    markObject(OBJ_SLOT(klass->name), flags);
     markTable(&klass->methods, flags);
   } break;
   case OBJ_CLOSURE: {
     ObjClosure* closure = (ObjClosure*)object;
-    markObject((Obj*)closure->function, flags);
+    markObject(OBJ_SLOT(closure->function), flags);
     for (int i = 0; i < closure->upvalueCount; ++i) {
-      markObject((Obj*)closure->upvalues[i], flags);
+      markObject(OBJ_SLOT(closure->upvalues[i]), flags);
     }
   } break;
   case OBJ_FUNCTION: {
     ObjFunction* function = (ObjFunction*)object;
-    markObject((Obj*)function->name, flags);
-    markArray(&function->chunk.constants, flags);
+    markObject(OBJ_SLOT(function->name), flags);
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i) {
+      Value *constant = &constants->values[i];
+      Obj *before = IS_OBJ(*constant) ? AS_OBJ(*constant) : NULL;
+      markValue(constant, flags);
+      // constant index hashes objects by address, rebuild it
+      if (before != NULL && before != AS_OBJ(*constant))
+        function->chunk.constantIndexCount = 0;
+    }
   } break;
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance*)object;
-    markObject((Obj*)instance->klass, flags);
+    markObject(OBJ_SLOT(instance->klass), flags);
     markTable(&instance->fields, flags);
   } break;
   case OBJ_UPVALUE:
-    markValue(((ObjUpvalue*)object)->closed, flags);
+    markValue(&((ObjUpvalue*)object)->closed, flags);
     break;
   case OBJ_STRING: // strings are interned
     break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope*)object;
+    markObject(&rope->left, flags);
+    markObject(&rope->right, flags);
+    markObject(OBJ_SLOT(rope->flat), flags);
+  } break;
   case OBJ_MODULE:
     break;
   case OBJ_REFERENCE: {
     // weak ref to ObjModule
     ObjReference *ref = (ObjReference*)object;
-    markObject((Obj*)ref->mod, flags);
-    markObject((Obj*)ref->name, flags);
-    markObject((Obj*)ref->closure, flags);
+    markObject(OBJ_SLOT(ref->mod), flags);
+    markObject(OBJ_SLOT(ref->name), flags);
+    markObject(OBJ_SLOT(ref->closure), flags);
+    // chunk always belongs to a function, keep it with its function
+    if (ref->chunk != NULL) {
+      Obj *function = (Obj*)(
+        (char*)ref->chunk - offsetof(ObjFunction, chunk));
+      markObject(&function, flags);
+      // marking thread must not store to the objects it traces
+      if (&((ObjFunction*)function)->chunk != ref->chunk)
+        ref->chunk = &((ObjFunction*)function)->chunk;
+    }
    } break;
   case OBJ_NATIVE_PROP: case OBJ_NATIVE_FN:
   case OBJ_NATIVE_METHOD: case OBJ_PROTOTYPE:
@@ -153,7 +434,7 @@ static void blackenObject(Obj *object, ObjFlags flags) {
 
 static void markArray(ValueArray* array, ObjFlags flags) {
   for (int i = 0; i < array->count; ++i) {
-    markValue(array->values[i], flags);
+    markValue(&array->values[i], flags);
   }
 }
 
@@ -163,85 +444,541 @@ static void markRoots(ObjFlags flags) {
   markDebuggerRoots(flags);
 }
 
-static void traceReferences(ObjFlags flags) {
-  while (vm.grayCount > 0) {
-    Obj* object = vm.grayStack[--vm.grayCount];
+static void traceReferences(ObjStack *stack, ObjFlags flags) {
+  while (stack->count > 0) {
+    Obj* object = stack->objects[--stack->count];
     blackenObject(object, flags);
   }
 }
 
-static void traceOlderReferences(ObjFlags flags) {
-  Obj* object = vm.olderObjects;
-  while (object != NULL) {
+// vm.strings holds its keys weakly, drop the infant strings nothing
+// else kept and point the entries of survivors at their copy
+static void sweepInfantStrings() {
+  for (int i = 0; i < vm.infantStrings.count; ++i) {
+    Obj *string = vm.infantStrings.objects[i];
+    if (string->flags & GC_FORWARDED)
+      tableReplaceKey(&vm.strings, (ObjString*)string,
+                      (ObjString*)string->next);
+    else
+      tableDelete(&vm.strings, (ObjString*)string);
+  }
+  vm.infantStrings.count = 0;
+}
+
+// remembered older objects are the only older objects that can
+// point into the nursery, scanning them evacuates what they hold
+static void traceRemembered(ObjFlags flags) {
+  for (int i = 0; i < vm.remembered.count; ++i) {
+    Obj *object = vm.remembered.objects[i];
+    object->flags &= ~GC_REMEMBERED;
     blackenObject(object, flags | GC_IS_OLDER);
-    object = object->next;
   }
+  vm.remembered.count = 0;
 }
 
-static void sweep(Obj** sweepList, ObjFlags flags) {
-  Obj *previous = NULL,
-      *object = *sweepList;
-  while (object != NULL) {
-    if ((object->flags & GC_FLAGS) >= flags) {
-      object->flags &= ~flags;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        *sweepList = object;
-      }
+// trace the fields of a marked older object, once per older collect,
+// the write barrier reads the scanned bit without holding markLock
+static void scanOlder(Obj *object) {
+  if (testOlderBit(object, POOL_SCAN_BITS, GC_SCANNED))
+    return;
+  blackenObject(object, GC_IS_MARKED_OLDER);
+  setOlderBit(object, POOL_SCAN_BITS, GC_SCANNED);
+}
+
+static void traceGray() {
+  while (vm.gray.count > 0)
+    scanOlder(vm.gray.objects[--vm.gray.count]);
+}
+
+static void pushGray(Obj *object) {
+  MarkWorker *worker = currentWorker;
+  if (worker == NULL) {
+    pushStack(&vm.gray, object);
+    return;
+  }
+  pthread_mutex_lock(&worker->lock);
+  pushStack(&worker->gray, object);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+static Obj *popWork(MarkWorker *worker) {
+  Obj *object = NULL;
+  pthread_mutex_lock(&worker->lock);
+  if (worker->gray.count > 0)
+    object = worker->gray.objects[--worker->gray.count];
+  pthread_mutex_unlock(&worker->lock);
+  return object;
+}
 
-      freeObject(unreached);
+// take the older half of some other worker's deque
+static bool stealWork(MarkWorker *self) {
+  for (int i = 1; i < markWorkerCount; ++i) {
+    MarkWorker *victim = &markWorkers[(self->index + i) % markWorkerCount];
+    pthread_mutex_lock(&victim->lock);
+    int count = (victim->gray.count +1) / 2;
+    if (count == 0) {
+      pthread_mutex_unlock(&victim->lock);
+      continue;
     }
+    Obj **stolen = malloc(sizeof(Obj*) * count);
+    if (stolen == NULL) {
+      fprintf(stderr, "Failed to allocate working memory during GC run.");
+      exit(1);
+    }
+    memcpy(stolen, victim->gray.objects, sizeof(Obj*) * count);
+    victim->gray.count -= count;
+    memmove(victim->gray.objects, victim->gray.objects + count,
+            sizeof(Obj*) * victim->gray.count);
+    pthread_mutex_unlock(&victim->lock);
+
+    pthread_mutex_lock(&self->lock);
+    for (int j = 0; j < count; ++j)
+      pushStack(&self->gray, stolen[j]);
+    pthread_mutex_unlock(&self->lock);
+    free(stolen);
+    return true;
   }
+  return false;
 }
 
-static void moveGenList(Obj** fromList, Obj** toList,
-                        ObjFlags removeFlags, ObjFlags setFlags)
-{
-  Obj **toPtr = *toList != NULL ? &(*toList)->next : toList;
-  if (*fromList) {
-    *toPtr = *fromList;
-    *fromList = NULL;
+static bool anyWork() {
+  for (int i = 0; i < markWorkerCount; ++i) {
+    MarkWorker *worker = &markWorkers[i];
+    pthread_mutex_lock(&worker->lock);
+    int count = worker->gray.count;
+    pthread_mutex_unlock(&worker->lock);
+    if (count > 0) return true;
   }
+  return false;
+}
 
-  Obj* object = *toList;
-  while (object != NULL) {
-    object->flags &= ~removeFlags;
-    object->flags |= setFlags;
-    object = object->next;
+// trace until every worker is out of work, only busy workers push,
+// so no work is left once all of them are idle at the same time
+static void runMarkWorker(MarkWorker *self) {
+  for (;;) {
+    Obj *object;
+    while ((object = popWork(self)) != NULL)
+      scanOlder(object);
+    if (stealWork(self)) continue;
+
+    __atomic_add_fetch(&markWorkersIdle, 1, __ATOMIC_ACQ_REL);
+    while (!anyWork()) {
+      if (__atomic_load_n(&markWorkersIdle, __ATOMIC_ACQUIRE) ==
+            markWorkerCount)
+        return;
+      sched_yield();
+    }
+    __atomic_sub_fetch(&markWorkersIdle, 1, __ATOMIC_ACQ_REL);
   }
+}
 
-  vm.olderBytesAllocated += vm.infantBytesAllocated;
+static void *markWorkerMain(void *arg) {
+  MarkWorker *self = (MarkWorker*)arg;
+  unsigned epoch = 0;
+  currentWorker = self;
+  pthread_mutex_lock(&workersLock);
+  for (;;) {
+    while (markEpoch == epoch && !markWorkersStop)
+      pthread_cond_wait(&workersStart, &workersLock);
+    if (markWorkersStop) break;
+    epoch = markEpoch;
+    pthread_mutex_unlock(&workersLock);
+
+    runMarkWorker(self);
+
+    pthread_mutex_lock(&workersLock);
+    ++markWorkersDone;
+    pthread_cond_signal(&workersDone);
+  }
+  pthread_mutex_unlock(&workersLock);
+  return NULL;
+}
+
+static void startMarkWorkers() {
+  if (markWorkers != NULL) return;
+  markWorkers = calloc(markWorkerCount, sizeof(MarkWorker));
+  if (markWorkers == NULL) {
+    fprintf(stderr, "Failed to allocate GC mark workers.\n");
+    exit(1);
+  }
+  for (int i = 0; i < markWorkerCount; ++i) {
+    markWorkers[i].index = i;
+    pthread_mutex_init(&markWorkers[i].lock, NULL);
+  }
+  // worker 0 is the interpreter thread
+  for (int i = 1; i < markWorkerCount; ++i) {
+    if (pthread_create(&markWorkers[i].thread, NULL,
+                       markWorkerMain, &markWorkers[i]) != 0)
+    {
+      fprintf(stderr, "Failed to start GC mark worker.\n");
+      exit(1);
+    }
+    ++markWorkersStarted;
+  }
+}
+
+static void stopMarkWorkers() {
+  if (markWorkers == NULL) return;
+  pthread_mutex_lock(&workersLock);
+  markWorkersStop = true;
+  pthread_cond_broadcast(&workersStart);
+  pthread_mutex_unlock(&workersLock);
+  for (int i = 1; i <= markWorkersStarted; ++i)
+    pthread_join(markWorkers[i].thread, NULL);
+
+  for (int i = 0; i < markWorkerCount; ++i) {
+    freeStack(&markWorkers[i].gray);
+    pthread_mutex_destroy(&markWorkers[i].lock);
+  }
+  free(markWorkers);
+  markWorkers = NULL;
+  markWorkersStarted = 0;
+  markWorkersStop = false;
+  markEpoch = 0;
+}
+
+// drain the gray stack with all workers, each one starts out with
+// an equal share of it
+static void traceGrayParallel() {
+  startMarkWorkers();
+  for (int i = 0; vm.gray.count > 0; i = (i +1) % markWorkerCount)
+    pushStack(&markWorkers[i].gray, vm.gray.objects[--vm.gray.count]);
+
+  pthread_mutex_lock(&workersLock);
+  markWorkersIdle = markWorkersDone = 0;
+  ++markEpoch;
+  pthread_cond_broadcast(&workersStart);
+  pthread_mutex_unlock(&workersLock);
+
+  currentWorker = &markWorkers[0];
+  runMarkWorker(currentWorker);
+  currentWorker = NULL;
+
+  pthread_mutex_lock(&workersLock);
+  while (markWorkersDone < markWorkerCount -1)
+    pthread_cond_wait(&workersDone, &workersLock);
+  pthread_mutex_unlock(&workersLock);
+}
+
+static void *markThreadMain(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&markLock);
+  while (!markThreadStop) {
+    if (!vm.gcMarking || vm.gray.count == 0) {
+      pthread_cond_wait(&markCond, &markLock);
+      continue;
+    }
+
+    for (int i = 0; i < MARK_SLICE_CHECK && vm.gray.count > 0; ++i)
+      scanOlder(vm.gray.objects[--vm.gray.count]);
+
+    // let the interpreter in
+    if (__atomic_load_n(&markLockWaiters, __ATOMIC_RELAXED) > 0) {
+      pthread_mutex_unlock(&markLock);
+      sched_yield();
+      pthread_mutex_lock(&markLock);
+    }
+  }
+  pthread_mutex_unlock(&markLock);
+  return NULL;
+}
+
+static void stopMarkThread() {
+  if (!markThreadRunning) return;
+  pthread_mutex_lock(&markLock);
+  markThreadStop = true;
+  pthread_cond_signal(&markCond);
+  pthread_mutex_unlock(&markLock);
+  pthread_join(markThread, NULL);
+  markThreadRunning = markThreadStop = false;
+}
+
+// marking begins with an empty nursery, so every object that exists
+// is older, objects created after this are black, see markNewOlder
+static void startOlderMarking() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin older marking\n");
+#endif
+  // mark bits of unswept objects are from the last marking
+  finishSweep();
+  vm.gcMarking = true;
+  slicePromoted = stats.bytesPromoted;
+  markRoots(GC_IS_MARKED_OLDER);
+
+  if (concurrentMark) {
+    if (!markThreadRunning &&
+        pthread_create(&markThread, NULL, markThreadMain, NULL) != 0)
+    {
+      fprintf(stderr, "Failed to start GC marking thread.\n");
+      exit(1);
+    }
+    markThreadRunning = true;
+    pthread_cond_signal(&markCond);
+  }
+}
+
+// trace gray objects for the pause target, but at least
+// MARK_SLICE_WORK times the bytes promoted since the last slice so
+// marking outpaces the program, true when none are left
+static bool markSlice() {
+  uint64_t deadline = clockUs() + pauseTargetUs;
+  size_t promoted = stats.bytesPromoted - slicePromoted,
+         minWork = promoted * MARK_SLICE_WORK,
+         traced = 0;
+  slicePromoted = stats.bytesPromoted;
+  while (vm.gray.count > 0) {
+    for (int i = 0; i < MARK_SLICE_CHECK && vm.gray.count > 0; ++i) {
+      Obj *object = vm.gray.objects[--vm.gray.count];
+      traced += objectSize(object);
+      scanOlder(object);
+    }
+    if (traced >= minWork && clockUs() >= deadline) break;
+  }
+  return vm.gray.count == 0;
+}
+
+// runs when an older collect is done. With a cpu target the grow
+// factor follows the share of time spent in pauses since the last
+// older collect, the nursery grows along while many infants survive,
+// giving them longer to die, and shrinks back when pauses are rare
+static void tuneHeap() {
+  if (config.cpuTarget > 0) {
+    uint64_t now = clockUs();
+    double share = now > cycleStartUs ?
+      (double)(stats.pauseTotalUs - cyclePauseUs) / (now - cycleStartUs) : 0;
+    if (share > config.cpuTarget) {
+      growFactor = growFactor * 1.5 < GROW_FACTOR_MAX ?
+                     growFactor * 1.5 : GROW_FACTOR_MAX;
+      if (survivalRate > SURVIVAL_HIGH &&
+          nurserySize < config.nurserySize * NURSERY_SCALE_MAX)
+        nurserySize *= 2;
+    } else if (share < config.cpuTarget / 2) {
+      growFactor = growFactor / 1.25 > GROW_FACTOR_MIN ?
+                     growFactor / 1.25 : GROW_FACTOR_MIN;
+      if (nurserySize > config.nurserySize)
+        nurserySize /= 2;
+    }
+    cycleStartUs = now;
+    cyclePauseUs = stats.pauseTotalUs;
+  }
+
+  size_t next = vm.olderBytesAllocated * growFactor;
+  vm.olderNextGC = next > config.olderMin ? next : config.olderMin;
+  if (config.maxHeap == 0) return;
+  if (vm.olderBytesAllocated > config.maxHeap) {
+    fprintf(stderr, "Heap limit of %zu bytes exceeded, %zu bytes live.\n",
+            config.maxHeap, vm.olderBytesAllocated);
+    exit(1);
+  }
+  if (vm.olderNextGC > config.maxHeap)
+    vm.olderNextGC = config.maxHeap;
+}
+
+// parse a number with an optional K, M or G suffix for sizes
+static bool parseSetting(const char *value, bool size, double *number) {
+  char *end;
+  *number = strtod(value, &end);
+  if (end == value || *number < 0) return false;
+  if (size) {
+    switch (*end) {
+    case 'k': case 'K': *number *= 1024; ++end; break;
+    case 'm': case 'M': *number *= 1024 * 1024; ++end; break;
+    case 'g': case 'G': *number *= 1024 * 1024 * 1024; ++end; break;
+    }
+  }
+  return *end == '\0' || *end == ',';
+}
+
+// sweep at most count objects or bitmap words, true when the sweep
+// is done
+static bool sweepSome(int count) {
+  if (sweepLink == NULL) return true;
+
+  while (*sweepLink != NULL && count-- > 0) {
+    Obj *object = *sweepLink;
+    if (isMarked(object, GC_IS_MARKED_OLDER)) {
+      object->flags &= ~(GC_IS_MARKED_OLDER | GC_SCANNED);
+      sweepLink = &object->next;
+    } else {
+      *sweepLink = object->next;
+      freeObject(object);
+    }
+  }
+
+  // only unmarked slots are returned, uncollectable ones among them
+  while (count > 0 && !poolWalkDone(&sweepCursor)) {
+    Obj *object = (Obj*)poolWalkNext(&sweepCursor, &count);
+    if (object == NULL) continue;
+    --count;
+    if (!isMarked(object, GC_IS_MARKED_OLDER))
+      freeObject(object);
+  }
+  if (*sweepLink != NULL || !poolWalkDone(&sweepCursor)) return false;
+
+  // survivors go in front of the objects created while sweeping
+  *sweepLink = vm.olderObjects;
+  vm.olderObjects = unswept;
+  unswept = NULL;
+  sweepLink = NULL;
+  poolClearBits(POOL_MARK_BITS);
+  poolClearBits(POOL_SCAN_BITS);
+  tuneHeap();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end older sweep\n");
+  printf("   older %zu bytes next as %zu\n",
+         vm.olderBytesAllocated, vm.olderNextGC);
+#endif
+  return true;
+}
+
+static void finishSweep() {
+  while (!sweepSome(SWEEP_INFANT_STEP))
+    ;
+}
+
+// point the fields of object at the moved objects, natives are never
+// traced but their name might have moved
+static void forwardFields(Obj *object) {
+  switch (object->type) {
+  case OBJ_NATIVE_FN:
+    markObject(OBJ_SLOT(((ObjNativeFn*)object)->name), 0); break;
+  case OBJ_NATIVE_PROP:
+    markObject(OBJ_SLOT(((ObjNativeProp*)object)->name), 0); break;
+  case OBJ_NATIVE_METHOD:
+    markObject(OBJ_SLOT(((ObjNativeMethod*)object)->name), 0); break;
+  default:
+    blackenObject(object, 0);
+  }
+}
+
+// instead of sweeping, copy the marked older objects to new pool pages
+// and hand the old pages back to the system. Uncollectable objects
+// are held by C code and stay where they are, pinning their page.
+// Runs when marking is done and the nursery is empty, so every
+// reference is either a root or in a live older object
+static void compactOlderGeneration() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin older compact\n");
+#endif
+  ObjStack older = { 0, 0, NULL },
+           moved = { 0, 0, NULL };
+  // objects in pages are only found from the bitmaps of their page,
+  // which the compact moves aside
+  PoolCursor cursor;
+  poolWalkBegin(&cursor, false);
+  for (Obj *object; (object = poolWalkNext(&cursor, NULL)) != NULL;)
+    pushStack(&older, object);
+  for (Obj *object = vm.olderObjects; object != NULL; object = object->next)
+    pushStack(&older, object);
+  vm.olderObjects = NULL;
+  poolBeginCompact();
+
+  int live = 0;
+  for (int i = 0; i < older.count; ++i) {
+    Obj *object = older.objects[i];
+    if (!isMarked(object, GC_IS_MARKED_OLDER)) {
+      freeObject(object);
+      continue;
+    }
+
+    Obj *copy = object;
+    if (object->flags & GC_DONT_COLLECT) {
+      if (inPage(object))
+        poolSetBit(object, POOL_PIN_BITS);
+    } else {
+      size_t size = objectSize(object);
+      copy = (Obj*)poolAlloc(size);
+      memcpy(copy, object, size);
+      copy->flags = (object->flags & ~(GC_IN_PAGE | GC_IS_MARKED_OLDER |
+                                       GC_SCANNED)) |
+                    (poolInPage(size) ? GC_IN_PAGE : 0);
+      movePointersInto(object, copy);
+      // the old object stays readable until the references are updated
+      object->flags |= GC_FORWARDED;
+      object->next = copy;
+      pushStack(&moved, object);
+    }
+    if (!(copy->flags & GC_IN_PAGE)) {
+      copy->next = vm.olderObjects;
+      vm.olderObjects = copy;
+    }
+    older.objects[live++] = copy;
+  }
+  older.count = live;
+
+  compacting = true;
+  markRoots(0);
+  markTable(&vm.strings, 0);
+  for (int i = 0; i < vm.remembered.count; ++i)
+    markObject(&vm.remembered.objects[i], 0);
+  for (int i = 0; i < older.count; ++i)
+    forwardFields(older.objects[i]);
+  compacting = false;
+  forwardHeapProfile();
+
+  // objects in pages go with their page
+  for (int i = 0; i < moved.count; ++i)
+    poolFree(moved.objects[i], objectSize(moved.objects[i]));
+  freeStack(&moved);
+  freeStack(&older);
+  poolEndCompact();
+  stats.olderCompacts++;
+  tuneHeap();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end older compact\n");
+  printf("   older %zu bytes next as %zu\n",
+         vm.olderBytesAllocated, vm.olderNextGC);
+#endif
+}
+
+static void recordPause(uint64_t us) {
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS -1 && us >= (uint64_t)1 << bucket)
+    bucket++;
+  stats.pauses[bucket]++;
+  stats.pauseTotalUs += us;
+  if (us > stats.pauseMaxUs) stats.pauseMaxUs = us;
+}
+
+// arrays and tables don't know which generation owns them, they are
+// counted as infant bytes and promoted along with their owner, so
+// freeing one can exceed what is left of infant bytes
+static void discountBytes(size_t bytes) {
+  if (bytes <= vm.infantBytesAllocated) {
+    vm.infantBytesAllocated -= bytes;
+    return;
+  }
+  bytes -= vm.infantBytesAllocated;
   vm.infantBytesAllocated = 0;
+  vm.olderBytesAllocated -= bytes < vm.olderBytesAllocated ?
+                              bytes : vm.olderBytesAllocated;
 }
 
+// objects might be held by C code anywhere an allocation happens,
+// only request a collect, it runs at the next gcSafepoint
 static void checkGC() {
-  if (disableGC) return;
-
 #ifdef DEBUG_STRESS_GC
-  infantGarbageCollect();
+  vm.gcPending = true;
 #endif
 
   if (vm.infantBytesAllocated > vm.infantNextGC) {
-    infantGarbageCollect();
+    vm.gcPending = true;
   }
 }
 
  // ---------------------------------------------------------------
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  if (pointer != NULL && ((Obj*)pointer)->flags & GC_IS_OLDER)
-    vm.olderBytesAllocated += newSize - oldSize;
-  else
+  if (newSize > oldSize) {
     vm.infantBytesAllocated += newSize - oldSize;
-
-  if (newSize > oldSize)
+    stats.bytesAllocated += newSize - oldSize;
     checkGC();
+  } else {
+    discountBytes(oldSize - newSize);
+    stats.bytesFreed += oldSize - newSize;
+  }
 
   if (newSize == 0) {
 #if DEBUG_LOG_GC_FREE
@@ -256,11 +993,130 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-void markObject(Obj *object, ObjFlags flags) {
-  if (object == NULL ||
-      (object->flags & GC_FLAGS) >= flags)
+void *allocateObj(size_t size) {
+  if (!allocateOlder) {
+    if (nursery == NULL) {
+      nursery = nurseryTop = malloc(nurserySize);
+      if (nursery == NULL) {
+        fprintf(stderr, "Out of memory allocating nursery.\n");
+        exit(1);
+      }
+      nurseryEnd = nursery + nurserySize;
+    }
+
+    size_t aligned = NURSERY_ALIGN(size);
+    if ((size_t)(nurseryEnd - nurseryTop) >= aligned) {
+      Obj *object = (Obj*)nurseryTop;
+      nurseryTop += aligned;
+      object->flags = 0;
+      object->next = NULL;
+      vm.infantBytesAllocated += aligned;
+      stats.bytesAllocated += aligned;
+      checkGC();
+      return object;
+    }
+
+    // full until the next safepoint, tenure right away meanwhile
+    vm.gcPending = true;
+  }
+
+  // fields are set without barrier by the constructor
+  Obj *object = allocateOlderObj(size);
+  stats.bytesAllocated += size;
+  rememberObject(object);
+  markNewOlder(object);
+  return object;
+}
+
+void freeObj(Obj *object, size_t size) {
+  // nursery is emptied as a whole
+  if (inNursery(object)) return;
+
+#if DEBUG_LOG_GC_FREE
+  printf("free %p %zu bytes\n", (void*)object, size);
+#endif
+  vm.olderBytesAllocated -= size < vm.olderBytesAllocated ?
+                              size : vm.olderBytesAllocated;
+  stats.bytesFreed += size;
+  poolFree(object, size);
+}
+
+void writeBarrierBefore(Obj *owner) {
+  if (!vm.gcMarking || !(owner->flags & GC_IS_OLDER) ||
+      testOlderBit(owner, POOL_SCAN_BITS, GC_SCANNED))
+    return;
+
+  // marked as well, the marking thread leaves black objects be
+  lockMarking();
+  setOlderBit(owner, POOL_MARK_BITS, GC_IS_MARKED_OLDER);
+  scanOlder(owner);
+  if (markThreadRunning && vm.gray.count > 0)
+    pthread_cond_signal(&markCond);
+  unlockMarking();
+}
+
+void readBarrierWeak(Obj *object) {
+  if (!vm.gcMarking || !(object->flags & GC_IS_OLDER) ||
+      testOlderBit(object, POOL_MARK_BITS, GC_IS_MARKED_OLDER))
     return;
 
+  lockMarking();
+  markObject(&object, GC_IS_MARKED_OLDER);
+  if (markThreadRunning && vm.gray.count > 0)
+    pthread_cond_signal(&markCond);
+  unlockMarking();
+}
+
+void internedString(ObjString *string) {
+  if (!(string->obj.flags & GC_IS_OLDER))
+    pushStack(&vm.infantStrings, OBJ_CAST(string));
+
+  if (stringsNextGC > 0 && vm.strings.count > stringsNextGC &&
+      !vm.gcMarking && !olderRequested)
+    olderRequested = vm.gcPending = true;
+}
+
+void writeBarrierObject(Obj *owner) {
+  rememberObject(owner);
+}
+
+bool setAllocateOlder(bool older) {
+  bool old = allocateOlder;
+  allocateOlder = older;
+  return old;
+}
+
+void markObject(Obj **slot, ObjFlags flags) {
+  Obj *object = *slot;
+  if (object == NULL) return;
+
+  if (compacting) {
+    if (object->flags & GC_FORWARDED)
+      *slot = object->next;
+    return;
+  }
+
+  if (evacuating) {
+    // all older objects are traced anyway, only nursery ones move
+    if (inNursery(object))
+      *slot = object->flags & GC_FORWARDED ?
+                object->next : evacuate(object);
+    return;
+  }
+
+  if (flags == GC_IS_MARKED_OLDER) {
+    // infants are kept by the infant collect, older marking sees
+    // them while the nursery is in use. Workers might reach object
+    // at the same time, the bit is set atomically
+    ObjFlags current = __atomic_load_n(&object->flags, __ATOMIC_RELAXED);
+    if ((current & (GC_IS_OLDER | GC_DONT_COLLECT)) != GC_IS_OLDER ||
+        setOlderBit(object, POOL_MARK_BITS, GC_IS_MARKED_OLDER))
+      return;
+  } else {
+    if ((object->flags & GC_FLAGS) >= flags) return;
+    object->flags |= flags;
+  }
+
 #if DEBUG_LOG_GC_MARK
   printf("%p mark %s curflags%x setFlags:%x\n",
         (void*)object,
@@ -268,29 +1124,136 @@ void markObject(Obj *object, ObjFlags flags) {
         object->flags, flags);
 #endif
 
-  object->flags |= flags;
+  pushGray(object);
+}
+
+void markValue(Value *value, ObjFlags flags) {
+  if (IS_OBJ(*value)) {
+    Obj *object = AS_OBJ(*value);
+    markObject(&object, flags);
+    if (object != AS_OBJ(*value))
+      *value = OBJ_VAL(object);
+  }
+}
 
-  if (vm.grayCapacity < vm.grayCount +1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = (Obj**)realloc(vm.grayStack,
-                            sizeof(Obj*) * vm.grayCapacity);
-    if (vm.grayStack == NULL) {
-      fprintf(stderr, "Failed to allocate working memory during GC run.");
-      exit(1);
+bool isMarked(Obj *object, ObjFlags flags) {
+  if (flags == GC_IS_MARKED_OLDER && !(object->flags & GC_DONT_COLLECT))
+    return testOlderBit(object, POOL_MARK_BITS, GC_IS_MARKED_OLDER);
+  return (object->flags & GC_FLAGS) >= flags;
+}
+
+void getGCConfig(GCConfig *out) {
+  *out = config;
+}
+
+void setGCConfig(const GCConfig *settings) {
+  config = *settings;
+  if (config.nurserySize < 4096) config.nurserySize = 4096;
+  if (config.growFactor < GROW_FACTOR_MIN)
+    config.growFactor = GROW_FACTOR_MIN;
+  nurserySize = config.nurserySize;
+  growFactor = config.growFactor;
+  cycleStartUs = clockUs();
+  cyclePauseUs = stats.pauseTotalUs;
+}
+
+bool parseGCConfig(const char *settings) {
+  GCConfig parsed = config;
+  const char *key = settings;
+  while (*key != '\0') {
+    const char *value = strchr(key, '='),
+               *end = strchr(key, ',');
+    if (end == NULL) end = key + strlen(key);
+    int keyLength = (value != NULL && value < end) ? value - key : -1;
+#define IS_KEY(name) \
+    (keyLength == sizeof(name) -1 && memcmp(key, name, keyLength) == 0)
+
+    double number;
+    bool ok = keyLength > 0 &&
+              parseSetting(value +1, !IS_KEY("grow") &&
+                                     !IS_KEY("cpu-target"), &number);
+    if (ok) {
+      if (IS_KEY("nursery"))         parsed.nurserySize = number;
+      else if (IS_KEY("infant-min")) parsed.infantMin = number;
+      else if (IS_KEY("older-min"))  parsed.olderMin = number;
+      else if (IS_KEY("max-heap"))   parsed.maxHeap = number;
+      else if (IS_KEY("grow"))       parsed.growFactor = number;
+      else if (IS_KEY("cpu-target")) parsed.cpuTarget = number;
+      else ok = false;
     }
+#undef IS_KEY
+
+    if (!ok) {
+      fprintf(stderr, "Bad GC setting \"%.*s\".\n", (int)(end - key), key);
+      return false;
+    }
+    key = *end == ',' ? end +1 : end;
   }
+  setGCConfig(&parsed);
+  return true;
+}
+
+void initGCThresholds() {
+  vm.infantNextGC = config.infantMin;
+  vm.olderNextGC = config.olderMin;
+}
+
+void getGCStats(GCStats *out) {
+  *out = stats;
+}
 
-  vm.grayStack[vm.grayCount++] = object;
+void printGCStats(FILE *out) {
+  fprintf(out, "gc: %zu infant collects, %zu older collects, %zu compacts\n",
+          stats.infantCollects, stats.olderCollects, stats.olderCompacts);
+  fprintf(out, "gc: %zu bytes allocated, %zu freed, %zu promoted\n",
+          stats.bytesAllocated, stats.bytesFreed, stats.bytesPromoted);
+  fprintf(out, "gc: pauses %luus in total, %luus at most\n",
+          (unsigned long)stats.pauseTotalUs,
+          (unsigned long)stats.pauseMaxUs);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+    if (stats.pauses[i] == 0) continue;
+    if (i < GC_PAUSE_BUCKETS -1)
+      fprintf(out, "gc:   < %8luus %lu\n", 1ul << i,
+              (unsigned long)stats.pauses[i]);
+    else
+      fprintf(out, "gc:   longer       %lu\n",
+              (unsigned long)stats.pauses[i]);
+  }
 }
 
-void markValue(Value value, ObjFlags flags) {
-  if (IS_OBJ(value)) markObject(AS_OBJ(value), flags);
+bool walkObjects(bool (*visit)(Obj *object)) {
+  // dead objects are not to be visited
+  finishSweep();
+
+  // visit might allocate, so nurseryTop is read each round
+  for (char *pos = nursery; nursery != NULL && pos < nurseryTop;) {
+    Obj *object = (Obj*)pos;
+    pos += NURSERY_ALIGN(objectSize(object));
+    if (!visit(object)) return false;
+  }
+
+  PoolCursor cursor;
+  poolWalkBegin(&cursor, false);
+  for (Obj *object; (object = poolWalkNext(&cursor, NULL)) != NULL;) {
+    if (!visit(object)) return false;
+  }
+
+  for (Obj *object = vm.olderObjects; object != NULL;
+       object = object->next)
+  {
+    if (!visit(object)) return false;
+  }
+  return true;
 }
 
 void freeObjects() {
-  Obj *lists[] = { vm.infantObjects, vm.olderObjects };
+  PoolCursor cursor;
+  poolWalkBegin(&cursor, false);
+  for (Obj *object; (object = poolWalkNext(&cursor, NULL)) != NULL;)
+    freeObject(object);
 
-  for (int i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+  Obj *lists[] = { vm.olderObjects, unswept };
+  for (int i = 0; i < 2; ++i) {
     Obj *object = lists[i];
     while (object != NULL) {
       Obj *next = object->next;
@@ -298,8 +1261,26 @@ void freeObjects() {
       object = next;
     }
   }
+  vm.olderObjects = unswept = NULL;
+  sweepLink = NULL;
+
+  for (char *pos = nursery; pos < nurseryTop;) {
+    Obj *object = (Obj*)pos;
+    pos += NURSERY_ALIGN(objectSize(object));
+    freeObjectContents(object);
+  }
+  free(nursery);
+  nursery = nurseryTop = nurseryEnd = NULL;
 
-  free(vm.grayStack);
+  stopMarkThread();
+  stopMarkWorkers();
+  freeStack(&vm.gray);
+  freeStack(&vm.scan);
+  freeStack(&vm.remembered);
+  freeStack(&vm.infantStrings);
+  heapProfileForgetObjects();
+  vm.gcMarking = false;
+  freePools();
 }
 
 bool setGCenabled(bool enable) {
@@ -309,63 +1290,139 @@ bool setGCenabled(bool enable) {
   return enabled;
 }
 
+void setGCPauseTarget(int microseconds) {
+  pauseTargetUs = microseconds > 0 ? microseconds : 0;
+}
+
+void setGCThreads(int threads) {
+  stopMarkWorkers();
+  markWorkerCount = threads > 1 ? threads : 1;
+}
+
+void setGCConcurrent(bool concurrent) {
+  stopMarkThread();
+  concurrentMark = concurrent;
+}
+
+void setGCCompact(bool compact) {
+  compactOlder = compact;
+}
+
+void setGCStringCap(int strings) {
+  stringCap = stringsNextGC = strings > 0 ? strings : 0;
+}
+
+void gcSafepoint() {
+  if (vm.gcPending && !disableGC)
+    infantGarbageCollect();
+}
+
 void infantGarbageCollect() {
-  disableGC = false;
+  // no collect from within a collect
+  bool enabled = !disableGC;
+  disableGC = true;
+  lockMarking();
+  vm.gcPending = false;
+  uint64_t start = clockUs();
+  stats.infantCollects++;
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin infant collect\n");
-  size_t before = vm.infantBytesAllocated;
+  size_t before = vm.infantBytesAllocated,
+         olderBefore = vm.olderBytesAllocated;
 #endif
 
+  size_t nurseryUsed = nurseryTop - nursery,
+         promoted = stats.bytesPromoted;
+  evacuating = true;
   markRoots(GC_IS_MARKED);
-  traceReferences(GC_IS_MARKED);
-  traceOlderReferences(GC_IS_MARKED);
-  sweepVM(GC_IS_MARKED);
-  sweep(&vm.infantObjects, GC_IS_MARKED);
-  moveGenList(&vm.infantObjects, &vm.olderObjects,
-              GC_IS_MARKED, GC_IS_OLDER);
+  traceRemembered(GC_IS_MARKED);
+  traceReferences(&vm.scan, GC_IS_MARKED);
+  evacuating = false;
+  sweepInfantStrings();
+  sweepHeapProfile(GC_IS_MARKED);
+  resetNursery();
+  if (nurseryUsed > 0)
+    survivalRate = survivalRate * 0.75 +
+      (double)(stats.bytesPromoted - promoted) / nurseryUsed * 0.25;
+
+  // what is left is owned by the survivors, now older
+  vm.olderBytesAllocated += vm.infantBytesAllocated;
+  vm.infantBytesAllocated = 0;
 
 #ifdef DEBUG_STRESS_GC_OLDER
   olderGarbageCollect();
 #endif
 
-  vm.infantNextGC = vm.infantBytesAllocated > INFANT_GC_MIN ?
-    vm.infantBytesAllocated * GC_HEAP_GROW_FACTOR : INFANT_GC_MIN;
+  // a nursery grown by the controller takes as much longer to fill
+  vm.infantNextGC = (double)config.infantMin * nurserySize /
+                      config.nurserySize;
 
-  if (vm.infantBytesAllocated + vm.olderBytesAllocated >
-      vm.infantNextGC + vm.olderNextGC)
+  // older bytes are only known once the last sweep is done
+  if (!vm.gcMarking && sweepSome(SWEEP_INFANT_STEP) &&
+      (olderRequested || vm.olderBytesAllocated > vm.olderNextGC))
   {
-    olderGarbageCollect();
+    if (pauseTargetUs > 0 || concurrentMark)
+      startOlderMarking();
+    else
+      olderGarbageCollect();
   }
 
+  // finish once all gray objects are traced, by the marking thread
+  // or in a slice here
+  if (vm.gcMarking &&
+      (concurrentMark ? vm.gray.count == 0 :
+                        markSlice()))
+    olderGarbageCollect();
+
 #ifdef DEBUG_LOG_GC
   printf("-- gc end infant collect\n");
-  printf("   collected %zu bytes (from %zu to %zu) next as %zu\n",
-        before - vm.infantBytesAllocated, before, vm.infantBytesAllocated,
-        vm.infantNextGC);
+  printf("   collected %zu bytes, promoted %zu bytes next as %zu\n",
+        before, vm.olderBytesAllocated - olderBefore, vm.infantNextGC);
 #endif
 
-  disableGC = true;
+  unlockMarking();
+  disableGC = !enabled;
+  recordPause(clockUs() - start);
 }
 
 void olderGarbageCollect() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin older collect\n");
-  size_t before = vm.olderBytesAllocated;
 #endif
 
-markRoots(GC_IS_MARKED_OLDER);
-traceReferences(GC_IS_MARKED_OLDER);
-sweepVM(GC_IS_MARKED);
-sweep(&vm.olderObjects, GC_IS_MARKED_OLDER);
+  // finishes marking that is in progress, whatever the barrier
+  // grayed since the marking thread last looked
+  if (!vm.gcMarking) {
+    finishSweep();
+    markRoots(GC_IS_MARKED_OLDER);
+  }
+  if (markWorkerCount > 1)
+    traceGrayParallel();
+  else
+    traceGray();
+  vm.gcMarking = false;
+  stats.olderCollects++;
+  sweepVM(GC_IS_MARKED_OLDER);
+  sweepHeapProfile(GC_IS_MARKED_OLDER);
+  olderRequested = false;
+  if (stringCap > 0)
+    stringsNextGC = vm.strings.count * growFactor > stringCap ?
+                      vm.strings.count * growFactor : stringCap;
 
-vm.olderNextGC = vm.olderBytesAllocated > OLDER_GC_MIN ?
-  vm.olderBytesAllocated * GC_HEAP_GROW_FACTOR : OLDER_GC_MIN;
+  if (compactOlder) {
+    compactOlderGeneration();
+    return;
+  }
+
+  // objects are swept as older ones are allocated and in steps by
+  // infant collects, see sweepSome
+  unswept = vm.olderObjects;
+  vm.olderObjects = NULL;
+  sweepLink = &unswept;
+  poolWalkBegin(&sweepCursor, true);
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end older collect\n");
-  printf("   collected older %zu bytes (from %zu to %zu) next as %zu\n",
-        before - vm.olderBytesAllocated, before, vm.olderBytesAllocated,
-        vm.olderNextGC);
+  printf("-- gc end older marking, sweeping %zu bytes\n",
+         vm.olderBytesAllocated);
 #endif
 }
-
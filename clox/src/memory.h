@@ -1,11 +1,18 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdio.h>
 #include "common.h"
 #include "object.h"
 
+// defaults of GCConfig
 #define INFANT_GC_MIN (1024 * 1024)
 #define OLDER_GC_MIN  (1024 * 1024)
+#define NURSERY_SIZE  (512 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+// pauses in bucket i took less than 2^i microseconds but at least
+// half as long, the last bucket takes all longer ones
+#define GC_PAUSE_BUCKETS 24
 
 
 #define ALLOCATE(type, count) \
@@ -23,12 +30,118 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
   reallocate(pointer, sizeof(type) * (oldCount), 0);
 
+// counted since the program started, over all VMs
+typedef struct GCStats {
+  size_t infantCollects,
+         olderCollects,  // finished older markings
+         olderCompacts,  // older collects that moved objects
+         bytesAllocated, // objects, arrays and tables
+         bytesFreed,
+         bytesPromoted;  // infants copied out to older
+  uint64_t pauseTotalUs,
+           pauseMaxUs,
+           pauses[GC_PAUSE_BUCKETS];
+} GCStats;
+
+typedef struct GCConfig {
+  size_t nurserySize, // infant objects are bump allocated from it
+         infantMin,   // bytes allocated between infant collects
+         olderMin,    // older bytes before the first older collect
+         maxHeap;     // older bytes allowed after a collect, 0 no limit
+  double growFactor,  // next older collect at live bytes times this
+         cpuTarget;   // fraction of time in GC pauses the adaptive
+                      // controller aims for, 0 keeps growFactor
+} GCConfig;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
-void markObject(Obj *object, ObjFlags flags);
-void markValue(Value value, ObjFlags flags);
+// allocate memory for a new object, only used by allocateObject
+// infant objects are bumped from the nursery, older ones come from
+// the size class pools, see pool.h
+void *allocateObj(size_t size);
+// give back memory of object, size as allocated
+void freeObj(Obj *object, size_t size);
+// allocate new objects directly in older generation, returns previous
+bool setAllocateOlder(bool older);
+// call after storing value in a field of owner, an older owner
+// that now points to an infant is remembered, infant collects only
+// scan older objects that are remembered
+#define WRITE_BARRIER(owner, value) \
+  do { \
+    if ((((Obj*)(owner))->flags & (GC_IS_OLDER | GC_REMEMBERED)) == \
+          GC_IS_OLDER && \
+        IS_OBJ(value) && !(AS_OBJ(value)->flags & GC_IS_OLDER)) \
+      writeBarrierObject(OBJ_CAST(owner)); \
+  } while (false)
+
+// call before changing the fields of owner in any way, while older
+// marking is in progress owner has its fields traced first so what
+// it pointed to when marking began is kept (snapshot at the beginning)
+#define PRE_WRITE_BARRIER(owner) \
+  do { \
+    if (vm.gcMarking) \
+      writeBarrierBefore(OBJ_CAST(owner)); \
+  } while (false)
+
+// call when a weak table such as vm.strings hands out object, while
+// older marking is in progress it might have been unreachable when
+// marking began and would be swept though used again
+#define WEAK_READ_BARRIER(object) \
+  do { \
+    if (vm.gcMarking) \
+      readBarrierWeak(OBJ_CAST(object)); \
+  } while (false)
+
+// slow path of PRE_WRITE_BARRIER
+void writeBarrierBefore(Obj *owner);
+// slow path of WEAK_READ_BARRIER
+void readBarrierWeak(Obj *object);
+// call when string is added to vm.strings, infant strings are
+// dropped from it or moved by the infant collect
+void internedString(ObjString *string);
+// remember older owner, for stores that can't name the values such
+// as copying a whole table into owner
+void writeBarrierObject(Obj *owner);
+// GC visits the fields holding objects, an infant collect moves the
+// nursery objects and updates the field with the new address
+void markObject(Obj **object, ObjFlags flags);
+void markValue(Value *value, ObjFlags flags);
+// whether object is marked by the collect using flags
+bool isMarked(Obj *object, ObjFlags flags);
 bool setGCenabled(bool enable);
+// longest pause in microseconds an older collect may add to an
+// infant collect, marking is then spread over several infant
+// collects, 0 marks and sweeps the older generation in one go
+void setGCPauseTarget(int microseconds);
+// threads marking the older generation when it's collected in one
+// go or marking is finished, 1 marks on the interpreter thread only
+void setGCThreads(int threads);
+// mark the older generation on a thread of its own, only marking
+// roots and sweeping stop the interpreter
+void setGCConcurrent(bool concurrent);
+// collect the older generation when more than strings are interned,
+// the limit grows with the strings that survive, 0 for no limit
+void setGCStringCap(int strings);
+// older collects copy the live objects together instead of sweeping,
+// giving the pages emptied back to the system
+void setGCCompact(bool compact);
+// collect if one is pending, allocation only requests collects,
+// they run where the VM knows no C code holds objects
+void gcSafepoint();
 void infantGarbageCollect();
 void olderGarbageCollect();
+void getGCConfig(GCConfig *config);
+void setGCConfig(const GCConfig *config);
+// set config from "key=value,key=value", keys are nursery, infant-min,
+// older-min and max-heap in bytes with an optional K, M or G suffix,
+// grow and cpu-target. Prints the bad setting and returns false
+bool parseGCConfig(const char *settings);
+// collect thresholds of a new VM
+void initGCThresholds();
+void getGCStats(GCStats *stats);
+// print a summary of the GC stats to out
+void printGCStats(FILE *out);
+// calls visit for each object, stops when it returns false
+bool walkObjects(bool (*visit)(Obj *object));
 void freeObjects();
 
 #endif // MEMORY_H
\ No newline at end of file
@@ -1,11 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "module.h"
 #include "memory.h"
 #include "compiler.h"
 #include "vm.h"
+#include "prefetch.h"
+
+// a cached import path resolution, canonical is NULL when the
+// requested path was not found (negative lookup)
+typedef struct ResolvedPath {
+  ObjString *canonical;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+} ResolvedPath;
+
+// requested path -> index into resolved
+static Table resolvedIndex = {0};
+static ResolvedPath *resolved = NULL;
+static int resolvedCount = 0,
+           resolvedCapacity = 0;
+
+static bool statFile(const char *path, struct stat *st) {
+  return stat(path, st) == 0 && S_ISREG(st->st_mode);
+}
+
+static bool sameFile(ResolvedPath *entry, struct stat *st) {
+  return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static ResolvedPath *newResolvedPath(ObjString *path) {
+  if (resolvedCapacity < resolvedCount +1) {
+    int oldCapacity = resolvedCapacity;
+    resolvedCapacity = GROW_CAPACITY(oldCapacity);
+    resolved = GROW_ARRAY(ResolvedPath, resolved,
+                          oldCapacity, resolvedCapacity);
+  }
+  tableSet(&resolvedIndex, path, NUMBER_VAL(resolvedCount));
+  return &resolved[resolvedCount++];
+}
+
+static ObjModule *lookupModule(ObjString *canonical) {
+  Value value;
+  if (tableGet(&vm.modulesByPath, canonical, &value))
+    return AS_MODULE(value);
+  return NULL;
+}
 
 // ------------------------------------------------------
 
@@ -15,6 +62,8 @@ void initModule(Module *module) {
   module->name = module->path = NULL;
   module->rootFunction = NULL;
   module->closure = NULL;
+  module->canonicalPath = NULL;
+  memset(&module->stats, 0, sizeof(module->stats));
   initTable(&module->exports);
 }
 
@@ -50,11 +99,15 @@ bool compileModule(Module *module, const char *source) {
                strlen(module->source));
   size_t len = strlen(source);
   // take a copy of source, prevents unintentional free
-  char *src = ALLOCATE(char, len);
-  memcpy(src, source, len);
+  // tokens stored by compiler points into this copy
+  char *src = ALLOCATE(char, len +1);
+  memcpy(src, source, len +1);
   module->source = src;
 
-  module->rootFunction = compile(source, module, TYPE_SCRIPT);
+  uint64_t start = statsClock();
+  module->rootFunction = compile(module->source, module, TYPE_SCRIPT);
+  if (compileStatsEnabled)
+    statsAddTime(&module->stats, PHASE_COMPILE, start);
   setGCenabled(enabled);
 
   return module->rootFunction != NULL;
@@ -71,63 +124,168 @@ InterpretResult interpretModule(Module *module) {
 
 InterpretResult loadModule(Module *module) {
   //vm.currentModule = module;
-  const char *src = readFile(module->path->chars);
+  // modules restored from a snapshot are already compiled
+  if (module->rootFunction == NULL) {
+    // might have been read by a prefetch thread already
+    uint64_t start = statsClock();
+    char *src = module->canonicalPath != NULL ?
+      takePrefetchedSource(module->canonicalPath->chars) : NULL;
+    bool compiled, prefetched = src != NULL;
+    if (!prefetched)
+      src = readFile(module->path->chars);
+    if (compileStatsEnabled)
+      statsAddTime(&module->stats, PHASE_READ, start);
 
-  if (!compileModule(module, src))
-    return INTERPRET_COMPILE_ERROR;
+    compiled = compileModule(module, src);
+    if (prefetched) free(src);
+    else FREE_ARRAY(char, src, strlen(src) +1);
+    if (!compiled)
+      return INTERPRET_COMPILE_ERROR;
+  }
 
   int oldexitAtFrame = vm.exitAtFrame;
   vm.exitAtFrame = vm.frameCount;
+  uint64_t start = statsClock();
   InterpretResult res = interpretModule(module);
   vm.exitAtFrame = oldexitAtFrame;
 
+  // printed at exit, function bodies compiled later with -L add to them
+  if (compileStatsEnabled)
+    statsAddTime(&module->stats, PHASE_RUN, start);
+
   return res;
 }
 
-Value getModuleByPath(Value path) {
-  Module *mod = vm.modules;
-  for (; mod != NULL; mod = mod->next) {
-    if (valuesEqual(path, OBJ_VAL((Obj*)mod->path)))
-      return OBJ_VAL((Obj*)mod);
+static void printModuleStats(Module *module) {
+  printCompileStats(module->path != NULL ?
+                      module->path->chars : module->name->chars,
+                    &module->stats);
+}
+
+static void printStatsInLoadOrder(Module *module) {
+  // vm.modules has the last loaded first
+  if (module == NULL) return;
+  printStatsInLoadOrder(module->next);
+  printModuleStats(module);
+}
+
+void printAllCompileStats() {
+  if (compileStatsEnabled)
+    printStatsInLoadOrder(vm.modules);
+}
+
+bool canonicalModulePath(const char *path, char *canonical) {
+  struct stat st;
+  return statFile(path, &st) && realpath(path, canonical) != NULL;
+}
+
+ObjString *resolveModulePath(ObjString *path) {
+  bool enabled = setGCenabled(false);
+  struct stat st;
+  bool exists = statFile(path->chars, &st);
+
+  // a stat is enough to tell if a cached entry is still valid
+  Value idx;
+  ResolvedPath *entry;
+  if (tableGet(&resolvedIndex, path, &idx)) {
+    entry = &resolved[(int)AS_NUMBER(idx)];
+    if ((!exists && entry->canonical == NULL) ||
+        (exists && entry->canonical != NULL && sameFile(entry, &st)))
+    {
+      setGCenabled(enabled);
+      return entry->canonical;
+    }
+  } else
+    entry = newResolvedPath(path);
+
+  entry->canonical = NULL;
+  char buf[PATH_MAX];
+  if (exists && canonicalModulePath(path->chars, buf)) {
+    entry->canonical = copyString(buf, strlen(buf));
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
   }
 
-  // not yet loaded
-  PathInfo pNfo = parsePath(AS_CSTRING(path));
-  if (fileExists(pNfo.path)) {
-    Module *mod = ALLOCATE(Module, 1);
+  setGCenabled(enabled);
+  return entry->canonical;
+}
+
+Value getModuleByPath(Value path) {
+  ObjString *canonical = resolveModulePath(AS_STRING(path));
+  if (canonical == NULL)
+    return NIL_VAL;
+
+  ObjModule *omod = lookupModule(canonical);
+  if (omod != NULL && omod->module->closure != NULL)
+    return OBJ_VAL((Obj*)omod);
+
+  // restored from snapshot but not yet run, or not yet loaded
+  bool restored = omod != NULL;
+  Module *mod;
+  if (restored)
+    mod = omod->module;
+  else {
+    PathInfo pNfo = parsePath(AS_CSTRING(path));
+    bool enabled = setGCenabled(false);
+    mod = ALLOCATE(Module, 1);
     initModule(mod);
-    addModuleVM(mod);
     mod->path = copyString(pNfo.path, pNfo.pathLen);
     mod->name = copyString(pNfo.basename, pNfo.basenameLen);
-    if (loadModule(mod) == INTERPRET_OK)
-      return OBJ_VAL((Obj*)newModule(mod));
-    // failed, remove from vm
-    delModuleVM(mod);
+    addModuleVM(mod);
+    setGCenabled(enabled);
   }
 
+  // top level code might collect, moving canonical and the module
+  Value canonicalRoot = OBJ_VAL((Obj*)canonical);
+  pushRoot(&canonicalRoot);
+  InterpretResult res = loadModule(mod);
+  popRoot();
+  if (res == INTERPRET_OK) {
+    // indexed under a path not yet on disk when it was added
+    omod = lookupModule(AS_STRING(canonicalRoot));
+    return omod != NULL ? OBJ_VAL((Obj*)omod) : NIL_VAL;
+  }
+
+  // failed, remove from vm, its stats won't be there at exit
+  if (!restored) {
+    if (compileStatsEnabled)
+      printModuleStats(mod);
+    delModuleVM(mod);
+  }
   return NIL_VAL;
 }
 
 Value getModuleByName(Value name) {
-  Module *mod = vm.modules;
-  for (; mod != NULL; mod = mod->next) {
-    if (valuesEqual(OBJ_VAL((Obj*)mod->name), name)) {
-      ObjModule *omod = newModule(mod);
-      return OBJ_VAL((Obj*)omod);
-    }
-  }
-
-  ObjString *path = concatString(AS_STRING(name)->chars, "lox",
-                                 AS_STRING(name)->length, 3);
+  // modules in different directories may share a name, the path
+  // name.lox resolves to is what identifies the module
+  ObjString *path = concatString(AS_STRING(name)->chars, ".lox",
+                                 AS_STRING(name)->length, 4);
   return getModuleByPath(OBJ_VAL((Obj*)path));
 }
 
 void markRootsModule(Module *module, ObjFlags flags) {
-  markObject(OBJ_CAST(module->name), flags);
-  markObject(OBJ_CAST(module->path), flags);
+  markObject(OBJ_SLOT(module->name), flags);
+  markObject(OBJ_SLOT(module->path), flags);
+  markObject(OBJ_SLOT(module->canonicalPath), flags);
+  markObject(OBJ_SLOT(module->rootFunction), flags);
+  markObject(OBJ_SLOT(module->closure), flags);
   markTable(&module->exports, flags);
 }
 
 void sweepModule(Module *module, ObjFlags flags) {
   tableRemoveWhite(&module->exports, flags);
-}
\ No newline at end of file
+}
+
+void markModuleResolveCache(ObjFlags flags) {
+  markTable(&resolvedIndex, flags);
+  for (int i = 0; i < resolvedCount; ++i)
+    markObject(OBJ_SLOT(resolved[i].canonical), flags);
+}
+
+void freeModuleResolveCache() {
+  freeTable(&resolvedIndex);
+  FREE_ARRAY(ResolvedPath, resolved, resolvedCapacity);
+  resolved = NULL;
+  resolvedCount = resolvedCapacity = 0;
+}
@@ -2,6 +2,7 @@
 #define LOX_MODULE_LOX
 
 #include "object.h"
+#include "compilestats.h"
 
 typedef enum InterpretResult InterpretResult;
 
@@ -9,9 +10,11 @@ typedef struct Module {
   Table  exports;
   const char *source;
   ObjString *name, *path;
+  ObjString *canonicalPath; // key in vm.modulesByPath
   ObjFunction *rootFunction;
   ObjClosure *closure;
   Module *next;
+  CompileStats stats; // filled in when compileStatsEnabled
 } Module;
 
 // create a new module, reciever takes ownership
@@ -26,7 +29,23 @@ InterpretResult interpretModule(Module *module);
 // load from file at path into module
 InterpretResult loadModule(Module *module);
 
+// print compile stats of all loaded modules when --compile-stats,
+// done at exit so lazy compiled function bodies are counted too
+void printAllCompileStats();
+
+// canonical (realpath) of the file at path into canonical, which
+// holds PATH_MAX chars, false if not a file. Doesn't use the GC heap
+// so prefetch threads resolve imports the same way as the loader
+bool canonicalModulePath(const char *path, char *canonical);
+
+// resolve path to its canonical (realpath) string, NULL if not a file
+// results are cached, negative ones too, and revalidated with stat
+ObjString *resolveModulePath(ObjString *path);
+
+// get module for path, loads it if not already loaded
+// returns NIL_VAL if not found or loading failed
 Value getModuleByPath(Value path);
+// get module name.lox, resolved like any other path
 Value getModuleByName(Value name);
 
 // init module
@@ -38,4 +57,9 @@ void markRootsModule(Module *module, ObjFlags flags);
 // GC sweep phase
 void sweepModule(Module *module, ObjFlags flags);
 
+// mark cached path resolutions during GC
+void markModuleResolveCache(ObjFlags flags);
+// free cached path resolutions
+void freeModuleResolveCache();
+
 #endif // LOX_MODULE_LOX
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "native.h"
 #include "vm.h"
+#include "memory.h"
+#include "array.h"
 
 #include <stdlib.h>
 #include <time.h>
@@ -22,6 +24,35 @@ static Value toNumber(int argCount, Value *args) {
   return NUMBER_VAL(dvlu);
 }
 
+static void setStat(ObjDict *dict, const char *name, double value) {
+  tableSet(&dict->fields, copyString(name, (int)strlen(name)),
+           NUMBER_VAL(value));
+}
+
+// counters of the GC as a dict, pauses is the histogram where index
+// i counts pauses shorter than 2^i microseconds
+static Value gcStatsNative(int argCount, Value *args) {
+  GCStats stats;
+  getGCStats(&stats);
+
+  ObjDict *dict = newDict();
+  setStat(dict, "infantCollects", stats.infantCollects);
+  setStat(dict, "olderCollects", stats.olderCollects);
+  setStat(dict, "olderCompacts", stats.olderCompacts);
+  setStat(dict, "bytesAllocated", stats.bytesAllocated);
+  setStat(dict, "bytesFreed", stats.bytesFreed);
+  setStat(dict, "bytesPromoted", stats.bytesPromoted);
+  setStat(dict, "pauseTotalUs", stats.pauseTotalUs);
+  setStat(dict, "pauseMaxUs", stats.pauseMaxUs);
+
+  ObjArray *pauses = newArray();
+  tableSet(&dict->fields, copyString("pauses", 6),
+           OBJ_VAL(OBJ_CAST(pauses)));
+  for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+    pushValueArray(&pauses->arr, NUMBER_VAL(stats.pauses[i]));
+  return OBJ_VAL(OBJ_CAST(dict));
+}
+
 // ------------------------------------------------------------
 
 
@@ -46,4 +77,5 @@ void defineBuiltins() {
   defineNativeFn("clock", clockNative, 0);
   defineNativeFn("str", toString, 1);
   defineNativeFn("num", toNumber, 1);
+  defineNativeFn("gcStats", gcStatsNative, 0);
 }
\ No newline at end of file
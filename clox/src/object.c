@@ -7,6 +7,7 @@
 #include "table.h"
 #include "value.h"
 #include "vm.h"
+#include "heapprofile.h"
 
 #ifdef DEBUG_LOG_GC
 # ifndef DEBUG_LOG_GC_ALLOC
@@ -58,21 +59,18 @@ static Value setDictWithKey(Value obj, int argCount, Value *args) {
   (void)argCount;
   ObjDict *dict = AS_DICT(obj);
   ObjString *key = AS_STRING(args[0]);
+  PRE_WRITE_BARRIER(dict);
   tableSet(&dict->fields, key, args[1]);
+  WRITE_BARRIER(dict, args[1]);
   return args[1];
 }
 
-static ObjString *allocateString(char *chars, int length,
-                                 uint32_t hash)
-{
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
+static ObjString *addString(ObjString *string, uint32_t hash) {
   string->hash = hash;
-  string->obj.flags = GC_DONT_COLLECT;
+  string->obj.flags |= GC_DONT_COLLECT;
   tableSet(&vm.strings, string, NIL_VAL);
-  string->obj.flags = 0;
-  string->obj.prototype = objStringPrototype;
+  string->obj.flags &= ~GC_DONT_COLLECT;
+  internedString(string);
   return string;
 }
 
@@ -114,7 +112,7 @@ static int dictToString(char **pbuf, ObjDict *dict) {
     if (tableGet(&dict->fields, AS_STRING(key), &value)) {
       len += AS_STRING(key)->length + 1;
       tmp = valueToString(value);
-      if (IS_STRING(value))
+      if (IS_STRING(value) || IS_ROPE(value))
         tmp = quoteString(tmp);
       len += tmp->length;
       pushValueArray(&parts, OBJ_VAL(OBJ_CAST(tmp)));
@@ -149,6 +147,36 @@ typedef struct PrototypeList {
 
 static PrototypeList *registeredTypes = NULL;
 
+static ObjRope *newRope(Obj *left, Obj *right, int length) {
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+// a flattened rope stands for its flat string
+static Obj *settledText(Obj *text) {
+  if (text->type == OBJ_ROPE && ((ObjRope*)text)->flat != NULL)
+    return OBJ_CAST(((ObjRope*)text)->flat);
+  return text;
+}
+
+static int textLength(Obj *text) {
+  return text->type == OBJ_ROPE ? ((ObjRope*)text)->length :
+                                  ((ObjString*)text)->length;
+}
+
+// strings and arrays have their own natives, all others share objPrototype
+static const ObjPrototype *objPrototypeOf(Obj *obj) {
+  switch (obj->type) {
+  case OBJ_STRING: return objStringPrototype;
+  case OBJ_ARRAY:  return objArrayPrototype;
+  default:         return objPrototype;
+  }
+}
+
 // -----------------------------------------------------------
 
 // exported globally
@@ -166,23 +194,23 @@ void initObjectsModule() {
 
   // init objPrototype prototype
   ObjString *toString_str = copyString("toString", 8);
-  toString_str->obj.flags = GC_DONT_COLLECT;
+  toString_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objPrototype->methodsNative, toString_str,
            OBJ_VAL((Obj*)newNativeMethod(objToStr, toString_str, 0)));
 
   // init string prototype
   ObjString *length_str = copyString("length", 6);
-  length_str->obj.flags = GC_DONT_COLLECT;
+  length_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objStringPrototype->propsNative, length_str,
           OBJ_VAL((Obj*)newNativeProp(getStrLen, NULL, length_str)));
 
   ObjString *set_index_str = copyString("__setitem__", 11);
-  set_index_str->obj.flags = GC_DONT_COLLECT;
+  set_index_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objStringPrototype->methodsNative, set_index_str,
            OBJ_VAL((Obj*)newNativeMethod(setStrAtIndex, set_index_str, 2)));
 
   ObjString *get_index_str = copyString("__getitem__", 11);
-  get_index_str->obj.flags = GC_DONT_COLLECT;
+  get_index_str->obj.flags |= GC_DONT_COLLECT;
   tableSet(&objStringPrototype->methodsNative, get_index_str,
            OBJ_VAL((Obj*)newNativeMethod(getStrAtIndex, get_index_str, 1)));
 
@@ -198,7 +226,7 @@ void freeObjectsModule() {
   // free prototypes
   PrototypeList *n = registeredTypes, *tmp;
   while (n != NULL) {
-    n->ptr->obj.flags |= ~GC_DONT_COLLECT;
+    n->ptr->obj.flags &= ~GC_DONT_COLLECT;
     tmp = n;
     n = n->next;
     FREE(PrototypeList, tmp);
@@ -207,13 +235,11 @@ void freeObjectsModule() {
 }
 
 Obj* allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj*)reallocate(NULL, 0, size);
+  // flags and next are set by allocateObj
+  Obj *object = (Obj*)allocateObj(size);
   object->type = type;
-  object->flags = 0;
-  object->prototype = objPrototype;
-
-  object->next = vm.infantObjects;
-  vm.infantObjects = object;
+  if (heapProfileEnabled)
+    heapProfileAlloc(object, size);
 
 #if DEBUG_LOG_GC_ALLOC
   printf("%p allocate %zu for %s\n", (void*)object, size, typeOfObject(object));
@@ -224,7 +250,7 @@ Obj* allocateObject(size_t size, ObjType type) {
 
 ObjPrototype *newPrototype(ObjPrototype *inherits){
   ObjPrototype *objProt = ALLOCATE_OBJ(ObjPrototype, OBJ_PROTOTYPE);
-  objProt->obj.flags = GC_DONT_COLLECT;
+  objProt->obj.flags |= GC_DONT_COLLECT;
   initTable(&objProt->methodsNative);
   initTable(&objProt->propsNative);
   objProt->prototype = inherits;
@@ -236,6 +262,7 @@ ObjPrototype *newPrototype(ObjPrototype *inherits){
     prev = &regPtr->next;
   *prev = ALLOCATE(PrototypeList, 1);
   (*prev)->ptr = objProt;
+  (*prev)->next = NULL;
   // return it
   return objProt;
 }
@@ -295,7 +322,7 @@ ObjInstance *newInstance(ObjClass *klass) {
 
 ObjNativeFn *newNativeFn(NativeFn function, ObjString *name, int arity) {
   ObjNativeFn* native = ALLOCATE_OBJ(ObjNativeFn, OBJ_NATIVE_FN);
-  native->obj.flags = GC_DONT_COLLECT;
+  native->obj.flags |= GC_DONT_COLLECT;
   native->function = function;
   native->arity = arity;
   native->name = name;
@@ -304,7 +331,7 @@ ObjNativeFn *newNativeFn(NativeFn function, ObjString *name, int arity) {
 
 ObjNativeProp *newNativeProp(NativePropGet getFn, NativePropSet setFn, ObjString *name) {
   ObjNativeProp *prop = ALLOCATE_OBJ(ObjNativeProp, OBJ_NATIVE_PROP);
-  prop->obj.flags = GC_DONT_COLLECT;
+  prop->obj.flags |= GC_DONT_COLLECT;
   prop->name = name;
   prop->getFn = getFn;
   prop->setFn = setFn;
@@ -313,6 +340,7 @@ ObjNativeProp *newNativeProp(NativePropGet getFn, NativePropSet setFn, ObjString
 
 ObjNativeMethod *newNativeMethod(NativeMethod function, ObjString *name, int arity) {
   ObjNativeMethod *method = ALLOCATE_OBJ(ObjNativeMethod, OBJ_NATIVE_METHOD);
+  method->obj.flags |= GC_DONT_COLLECT;
   method->arity = arity;
   method->method = function;
   method->name = name;
@@ -353,20 +381,36 @@ Value refGet(ObjReference *ref) {
 
 // set function for reference
 void refSet(ObjReference *ref, Value value) {
-  *ref->closure->upvalues[ref->index]->location = value;
+  ObjUpvalue *upvalue = ref->closure->upvalues[ref->index];
+  PRE_WRITE_BARRIER(upvalue);
+  *upvalue->location = value;
+  WRITE_BARRIER(upvalue, value);
 }
 
-// takes a string (as in owning memory for it)
-ObjString *takeString(char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString *newString(int length) {
+  ObjString *string = (ObjString*)allocateObject(
+    sizeof(ObjString) + length +1, OBJ_STRING);
+  string->length = length;
+  string->chars[length] = '\0';
+  return string;
+}
 
+ObjString *internString(ObjString *string) {
+  uint32_t hash = hashString(string->chars, string->length);
+  ObjString *interned = tableFindString(
+    &vm.strings, string->chars, string->length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length +1);
+    WEAK_READ_BARRIER(interned);
     return interned;
   }
+  return addString(string, hash);
+}
 
-  return allocateString(chars, length, hash);
+// takes a string (as in owning memory for it)
+ObjString *takeString(char *chars, int length) {
+  ObjString *string = copyString(chars, length);
+  FREE_ARRAY(char, chars, length +1);
+  return string;
 }
 
 // copy a string, chars memory is owned by caller
@@ -375,33 +419,35 @@ ObjString *copyString(const char *chars, int length) {
   // intern string
   ObjString *interned = tableFindString(
     &vm.strings, chars, length, hash);
-  if (interned != NULL) return interned;
+  if (interned != NULL) {
+    WEAK_READ_BARRIER(interned);
+    return interned;
+  }
 
-  char *heapChars = ALLOCATE(char, length +1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString *string = newString(length);
+  memcpy(string->chars, chars, length);
+  return addString(string, hash);
 }
 
 // join 2 strings
 ObjString *concatString(const char *str1, const char *str2, int len1, int len2) {
-  char *heapChars = ALLOCATE(char, len1 + len2);
-  memcpy(heapChars, str1, len1);
-  memcpy(heapChars, str2, len2);
-  return takeString(heapChars, len1 + len2);
+  ObjString *string = newString(len1 + len2);
+  memcpy(string->chars, str1, len1);
+  memcpy(string->chars + len1, str2, len2);
+  return internString(string);
 }
 
 ObjString *quoteString(ObjString *valueStr) {
-  char *buf = ALLOCATE(char, valueStr->length + 3);
-  *buf = '"';
-  memcpy(buf+1, valueStr->chars, valueStr->length);
-  memcpy((buf+1+valueStr->length), "\"\0", 2);
-  return takeString(buf, valueStr->length+2);
+  ObjString *string = newString(valueStr->length +2);
+  string->chars[0] = '"';
+  memcpy(string->chars +1, valueStr->chars, valueStr->length);
+  string->chars[valueStr->length +1] = '"';
+  return internString(string);
 }
 
 Value objPropNative(Obj *obj, ObjString *name) {
   Value ret;
-  const ObjPrototype *p = obj->prototype;
+  const ObjPrototype *p = objPrototypeOf(obj);
   for (; p != NULL; p = p->prototype) {
     if (tableGet((Table*)&p->propsNative, name, &ret))
       return ret;
@@ -411,7 +457,7 @@ Value objPropNative(Obj *obj, ObjString *name) {
 
 Value objMethodNative(Obj *obj, ObjString *name) {
   Value ret;
-  const ObjPrototype *p = obj->prototype;
+  const ObjPrototype *p = objPrototypeOf(obj);
   for (; p != NULL; p = p->prototype) {
     if (tableGet((Table*)&p->methodsNative, name, &ret)) {
       return ret;
@@ -420,6 +466,73 @@ Value objMethodNative(Obj *obj, ObjString *name) {
   return NIL_VAL;
 }
 
+Obj *concatenateStrings(Obj *a, Obj *b) {
+  a = settledText(a);
+  b = settledText(b);
+  int length = textLength(a) + textLength(b);
+  if (length < ROPE_MIN_LENGTH) {
+    // ropes are longer, so both are strings
+    ObjString *left = (ObjString*)a, *right = (ObjString*)b,
+              *string = newString(length);
+    memcpy(string->chars, left->chars, left->length);
+    memcpy(string->chars + left->length, right->chars, right->length);
+    return OBJ_CAST(internString(string));
+  }
+
+  // appended a little at a time, gather the pieces in one leaf, it's
+  // never seen outside the rope so it isn't interned
+  if (a->type == OBJ_ROPE && b->type == OBJ_STRING) {
+    ObjRope *rope = (ObjRope*)a;
+    ObjString *last = (ObjString*)rope->right,
+              *piece = (ObjString*)b;
+    if (rope->right->type == OBJ_STRING &&
+        last->length + piece->length < ROPE_MIN_LENGTH)
+    {
+      ObjString *leaf = newString(last->length + piece->length);
+      memcpy(leaf->chars, last->chars, last->length);
+      memcpy(leaf->chars + last->length, piece->chars, piece->length);
+      leaf->hash = 0;
+      return OBJ_CAST(newRope(rope->left, OBJ_CAST(leaf), length));
+    }
+  }
+
+  return OBJ_CAST(newRope(a, b, length));
+}
+
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  // copied from the end, ropes built in a loop lean left, so few
+  // nodes wait on the stack
+  ObjString *string = newString(rope->length);
+  int count = 0, capacity = 8, pos = rope->length;
+  Obj **stack = ALLOCATE(Obj*, capacity);
+  stack[count++] = OBJ_CAST(rope);
+  while (count > 0) {
+    Obj *text = settledText(stack[--count]);
+    if (text->type == OBJ_STRING) {
+      ObjString *piece = (ObjString*)text;
+      pos -= piece->length;
+      memcpy(string->chars + pos, piece->chars, piece->length);
+      continue;
+    }
+    if (capacity < count +2) {
+      stack = GROW_ARRAY(Obj*, stack, capacity, capacity * 2);
+      capacity *= 2;
+    }
+    stack[count++] = ((ObjRope*)text)->left;
+    stack[count++] = ((ObjRope*)text)->right;
+  }
+  FREE_ARRAY(Obj*, stack, capacity);
+
+  // the pieces are not needed anymore
+  PRE_WRITE_BARRIER(rope);
+  rope->flat = internString(string);
+  rope->left = rope->right = NULL;
+  WRITE_BARRIER(rope, OBJ_VAL(OBJ_CAST(rope->flat)));
+  return rope->flat;
+}
+
 const char *typeOfObject(Obj* object) {
   switch (object->type){
   case OBJ_BOUND_METHOD: return "bound method";
@@ -437,6 +550,7 @@ const char *typeOfObject(Obj* object) {
   case OBJ_PROTOTYPE:    return "prototype";
   case OBJ_MODULE:       return "module";
   case OBJ_REFERENCE:  return "reference";
+  case OBJ_ROPE:       return "string";
   }
   return "undefined";
 }
@@ -504,6 +618,8 @@ ObjString *objectToString(Value value) {
   } break;
   case OBJ_STRING:
     ret = AS_STRING(value); break;
+  case OBJ_ROPE:
+    ret = flattenRope(AS_ROPE(value)); break;
   case OBJ_UPVALUE:
     ret = copyString("<upvalue>", 9); break;
   case OBJ_PROTOTYPE:
@@ -12,9 +12,12 @@
 
 #define OBJ_TYPE(value)            (AS_OBJ(value)->type)
 #define OBJ_CAST(value)            (Obj*)(value)
+// address of a field holding an object, for the GC to update
+#define OBJ_SLOT(field)            ((Obj**)&(field))
 
 #define IS_MODULE(value)           (isObjType(value, OBJ_MODULE))
 #define IS_REFERENCE(value)        (isObjType(value, OBJ_REFERENCE))
+#define IS_ROPE(value)             (isObjType(value, OBJ_ROPE))
 #define IS_BOUND_METHOD(value)     (isObjType(value, OBJ_BOUND_METHOD))
 #define IS_DICT(value)             (isObjType(value, OBJ_DICT))
 #define IS_CLASS(value)            (isObjType(value, OBJ_CLASS))
@@ -29,6 +32,7 @@
 
 #define AS_MODULE(value)           ((ObjModule*)AS_OBJ(value))
 #define AS_REFERENCE(value)        ((ObjReference*)AS_OBJ(value))
+#define AS_ROPE(value)             ((ObjRope*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)     ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_DICT(value)             ((ObjDict*)AS_OBJ(value))
 #define AS_CLASS(value)            ((ObjClass*)AS_OBJ(value))
@@ -46,12 +50,25 @@
         {.obj = takeString(string, length)}, VAL_OBJ})
 
 
-// Object lags
-#define GC_FLAGS                   0x08
+// Object flags, compared as numbers, an object counts as marked when
+// (flags & GC_FLAGS) >= the mark bit used, so older objects are live
+// during an infant collect and GC_DONT_COLLECT always is.
+// GC_DONT_COLLECT objects must be allocated older (setAllocateOlder)
+// as they are held from C and a nursery object can move.
+#define GC_FLAGS                   0x0F
 #define GC_IS_MARKED               0x01
 #define GC_IS_OLDER                0x02
 #define GC_IS_MARKED_OLDER         0x04
 #define GC_DONT_COLLECT            0x08
+// nursery object copied out, next points to the copy
+#define GC_FORWARDED               0x10
+// older object in the remembered set, see WRITE_BARRIER
+#define GC_REMEMBERED              0x20
+// fields traced by the older marking in progress, see PRE_WRITE_BARRIER
+#define GC_SCANNED                 0x40
+// older object in a pool page, GC_IS_MARKED_OLDER and GC_SCANNED are
+// then kept in the page bitmaps instead of flags, see isMarked
+#define GC_IN_PAGE                 0x80
 
 typedef struct Module Module;
 typedef struct ObjPrototype ObjPrototype;
@@ -71,14 +88,16 @@ typedef enum {
   OBJ_STRING,
   OBJ_UPVALUE,
   OBJ_MODULE,
-  OBJ_REFERENCE
+  OBJ_REFERENCE,
+  OBJ_ROPE
 } ObjType;
 
 
+// 16 bytes, type and flags share the first word. The prototype holding
+// the native methods follows from the type, see objMethodNative
 struct Obj {
-  ObjType type;
+  ObjType type : 8;
   ObjFlags flags;
-  const ObjPrototype *prototype;
   struct Obj* next;
 };
 
@@ -123,11 +142,12 @@ typedef struct ObjNativeMethod {
   ObjString *name;
 } ObjNativeMethod;
 
+// chars are stored inline, allocated along with the object
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
 
 typedef struct ObjUpvalue {
@@ -182,6 +202,22 @@ typedef struct ObjDict {
   Table fields;
 } ObjDict;
 
+// concatenations this long or longer make a rope
+#define ROPE_MIN_LENGTH 64
+
+// a string concatenated from left and right, their chars are copied
+// only once the contents are needed, by flattenRope. Building a string
+// piece by piece then takes linear time and leaves no intermediate
+// strings in vm.strings. Ropes stay in the VM, natives, equality and
+// printing get the flat string
+typedef struct ObjRope {
+  Obj obj;
+  int length;
+  Obj *left,  // ObjString or ObjRope, NULL once flattened
+      *right;
+  ObjString *flat;
+} ObjRope;
+
 
 void initObjectsModule();
 void freeObjectsModule();
@@ -208,6 +244,12 @@ Value refGet(ObjReference *ref);
 // set function for reference
 void refSet(ObjReference *ref, Value value);
 
+// uninterned string with room for length chars, fill them in and
+// pass it to internString
+ObjString      *newString(int length);
+// interns string from newString, when an equal string is interned
+// already that one is returned instead
+ObjString      *internString(ObjString *string);
 // takes chars intern them and return a ObjString
 // vm takes ownership of chars
 ObjString      *takeString(char *chars, int length);
@@ -216,6 +258,10 @@ ObjString      *takeString(char *chars, int length);
 ObjString      *copyString(const char *chars, int length);
 // concat str1 with str2
 ObjString      *concatString(const char *str1, const char *str2, int len1, int len2);
+// a and b are strings or ropes, returns a rope or an interned string
+Obj            *concatenateStrings(Obj *a, Obj *b);
+// the interned string with the chars of rope, copied the first time
+ObjString      *flattenRope(ObjRope *rope);
 // add quotes to string ie. "..."
 ObjString      *quoteString(ObjString *valueStr);
 // returns type of object
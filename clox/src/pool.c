@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+// under ASan each object is malloced on its own so use after free
+// of objects gets reported
+#if defined(__SANITIZE_ADDRESS__)
+# define POOL_BYPASS
+#endif
+
+typedef struct FreeSlot {
+  struct FreeSlot *next;
+} FreeSlot;
+
+// header of each page, padded so slots stay POOL_GRANULE aligned
+union PoolPage {
+  struct {
+    union PoolPage *next;
+    uint64_t *bits; // POOL_BITMAPS bitmaps of BITMAP_WORDS each
+    int sizeClass;
+    bool moving;    // compact in progress copies out of this page
+  };
+  char align[2 * POOL_GRANULE];
+};
+
+typedef struct SizeClass {
+  FreeSlot *freeList;
+  char *bump,    // next never used slot in newest page
+       *bumpEnd;
+} SizeClass;
+
+static SizeClass classes[POOL_CLASSES];
+static PoolPage *pages = NULL,
+                *movingPages = NULL, // during a compact
+                **released = NULL;   // unused, not backed by memory
+static int releasedCount = 0,
+           releasedCapacity = 0;
+static size_t pageBytes = 0;
+
+static int classIndex(size_t size) {
+  return (int)((size + POOL_GRANULE -1) / POOL_GRANULE) -1;
+}
+
+static PoolPage *pageOf(void *pointer) {
+  return (PoolPage*)((uintptr_t)pointer & ~(uintptr_t)(POOL_PAGE_SIZE -1));
+}
+
+// word of the bitmap holding the bit of slot, bit gets its mask
+static uint64_t *bitmapWord(void *pointer, PoolBitmap bitmap,
+                            uint64_t *bit)
+{
+  PoolPage *page = pageOf(pointer);
+  size_t granule = ((char*)pointer - (char*)page) / POOL_GRANULE;
+  *bit = (uint64_t)1 << (granule % 64);
+  return &page->bits[bitmap * BITMAP_WORDS + granule / 64];
+}
+
+// map a POOL_PAGE_SIZE aligned page, released ones are mapped still
+static PoolPage *mapPage() {
+  if (releasedCount > 0)
+    return released[--releasedCount];
+
+  // map twice the size and unmap what lies outside the aligned page
+  char *map = mmap(NULL, 2 * POOL_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) return NULL;
+  char *page = (char*)(((uintptr_t)map + POOL_PAGE_SIZE -1) &
+                       ~(uintptr_t)(POOL_PAGE_SIZE -1));
+  if (page > map)
+    munmap(map, page - map);
+  if (map + POOL_PAGE_SIZE > page)
+    munmap(page + POOL_PAGE_SIZE, map + POOL_PAGE_SIZE - page);
+  return (PoolPage*)page;
+}
+
+// give the memory of page back to the system, its address range is
+// kept for the next new page
+static void releasePage(PoolPage *page) {
+  free(page->bits);
+  madvise(page, POOL_PAGE_SIZE, MADV_DONTNEED);
+  if (releasedCapacity < releasedCount +1) {
+    releasedCapacity = releasedCapacity < 8 ? 8 : releasedCapacity * 2;
+    released = realloc(released, sizeof(PoolPage*) * releasedCapacity);
+    if (released == NULL) {
+      fprintf(stderr, "Out of memory releasing object page.\n");
+      exit(1);
+    }
+  }
+  released[releasedCount++] = page;
+  pageBytes -= POOL_PAGE_SIZE;
+}
+
+static void newPage(SizeClass *sizeClass) {
+  PoolPage *page = mapPage();
+  uint64_t *bits = calloc(POOL_BITMAPS * BITMAP_WORDS, sizeof(uint64_t));
+  if (page == NULL || bits == NULL) {
+    fprintf(stderr, "Out of memory allocating object page.\n");
+    exit(1);
+  }
+  page->bits = bits;
+  page->sizeClass = (int)(sizeClass - classes);
+  page->moving = false;
+  page->next = pages;
+  pages = page;
+  pageBytes += POOL_PAGE_SIZE;
+
+  // the tail of the previous page is less than one slot, leave it
+  sizeClass->bump = (char*)(page +1);
+  sizeClass->bumpEnd = (char*)page + POOL_PAGE_SIZE;
+}
+
+// ------------------------------------------------------
+
+void *poolAlloc(size_t size) {
+#ifndef POOL_BYPASS
+  if (size > POOL_MAX_SIZE || size == 0)
+#endif
+  {
+    void *pointer = malloc(size);
+    if (pointer == NULL) exit(1);
+    return pointer;
+  }
+
+  int idx = classIndex(size);
+  SizeClass *sizeClass = &classes[idx];
+  void *pointer = sizeClass->freeList;
+  if (pointer != NULL)
+    sizeClass->freeList = sizeClass->freeList->next;
+  else {
+    size_t slotSize = (size_t)(idx +1) * POOL_GRANULE;
+    if (sizeClass->bump == NULL ||
+        (size_t)(sizeClass->bumpEnd - sizeClass->bump) < slotSize)
+      newPage(sizeClass);
+    pointer = sizeClass->bump;
+    sizeClass->bump += slotSize;
+  }
+
+  uint64_t bit, *word = bitmapWord(pointer, POOL_LIVE_BITS, &bit);
+  *word |= bit;
+  return pointer;
+}
+
+void poolFree(void *pointer, size_t size) {
+  if (pointer == NULL) return;
+#ifndef POOL_BYPASS
+  if (size > POOL_MAX_SIZE || size == 0)
+#endif
+  {
+    free(pointer);
+    return;
+  }
+
+  // released along with its page
+  if (pageOf(pointer)->moving) return;
+
+  uint64_t bit, *word = bitmapWord(pointer, POOL_LIVE_BITS, &bit);
+  *word &= ~bit;
+  SizeClass *sizeClass = &classes[classIndex(size)];
+  FreeSlot *slot = (FreeSlot*)pointer;
+  slot->next = sizeClass->freeList;
+  sizeClass->freeList = slot;
+}
+
+bool poolInPage(size_t size) {
+#ifdef POOL_BYPASS
+  (void)size;
+  return false;
+#else
+  return size > 0 && size <= POOL_MAX_SIZE;
+#endif
+}
+
+bool poolTestBit(void *pointer, PoolBitmap bitmap) {
+  uint64_t bit, *word = bitmapWord(pointer, bitmap, &bit);
+  return __atomic_load_n(word, __ATOMIC_ACQUIRE) & bit;
+}
+
+bool poolSetBit(void *pointer, PoolBitmap bitmap) {
+  uint64_t bit, *word = bitmapWord(pointer, bitmap, &bit);
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return true;
+  return __atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit;
+}
+
+void poolClearBits(PoolBitmap bitmap) {
+  for (PoolPage *page = pages; page != NULL; page = page->next)
+    memset(&page->bits[bitmap * BITMAP_WORDS], 0,
+           BITMAP_WORDS * sizeof(uint64_t));
+}
+
+void poolBeginCompact() {
+  for (PoolPage *page = pages; page != NULL; page = page->next)
+    page->moving = true;
+  movingPages = pages;
+  pages = NULL;
+  for (int i = 0; i < POOL_CLASSES; ++i) {
+    classes[i].freeList = NULL;
+    classes[i].bump = classes[i].bumpEnd = NULL;
+  }
+}
+
+void poolEndCompact() {
+  while (movingPages != NULL) {
+    PoolPage *page = movingPages;
+    movingPages = page->next;
+
+    uint64_t *pins = &page->bits[POOL_PIN_BITS * BITMAP_WORDS];
+    bool pinned = false;
+    for (int i = 0; i < BITMAP_WORDS && !pinned; ++i)
+      pinned = pins[i] != 0;
+
+    if (!pinned) {
+      releasePage(page);
+      continue;
+    }
+
+    // every slot but the pinned ones is free now
+    SizeClass *sizeClass = &classes[page->sizeClass];
+    size_t slotSize = (size_t)(page->sizeClass +1) * POOL_GRANULE;
+    for (char *pos = (char*)(page +1);
+         pos + slotSize <= (char*)page + POOL_PAGE_SIZE; pos += slotSize)
+    {
+      uint64_t bit, *word = bitmapWord(pos, POOL_PIN_BITS, &bit);
+      if (*word & bit) continue;
+      FreeSlot *slot = (FreeSlot*)pos;
+      slot->next = sizeClass->freeList;
+      sizeClass->freeList = slot;
+    }
+    memset(page->bits, 0, POOL_PIN_BITS * BITMAP_WORDS * sizeof(uint64_t));
+    memcpy(&page->bits[POOL_LIVE_BITS * BITMAP_WORDS], pins,
+           BITMAP_WORDS * sizeof(uint64_t));
+    memset(pins, 0, BITMAP_WORDS * sizeof(uint64_t));
+    page->moving = false;
+    page->next = pages;
+    pages = page;
+  }
+}
+
+void poolWalkBegin(PoolCursor *cursor, bool unmarked) {
+  cursor->page = pages;
+  cursor->word = 0;
+  cursor->bits = 0;
+  cursor->unmarked = unmarked;
+}
+
+void *poolWalkNext(PoolCursor *cursor, int *steps) {
+  while (cursor->bits == 0) {
+    if (cursor->page == NULL) return NULL;
+    if (cursor->word == BITMAP_WORDS) {
+      cursor->page = cursor->page->next;
+      cursor->word = 0;
+      continue;
+    }
+    if (steps != NULL && (*steps)-- <= 0) return NULL;
+
+    uint64_t *bits = cursor->page->bits;
+    cursor->bits = bits[POOL_LIVE_BITS * BITMAP_WORDS + cursor->word];
+    if (cursor->unmarked)
+      cursor->bits &= ~bits[POOL_MARK_BITS * BITMAP_WORDS + cursor->word];
+    cursor->word++;
+  }
+
+  // a bit per granule, only the first granule of a slot has it set
+  int granule = (cursor->word -1) * 64 + __builtin_ctzll(cursor->bits);
+  cursor->bits &= cursor->bits -1;
+  return (char*)cursor->page + (size_t)granule * POOL_GRANULE;
+}
+
+bool poolWalkDone(PoolCursor *cursor) {
+  return cursor->page == NULL && cursor->bits == 0;
+}
+
+size_t poolPageBytes() {
+  return pageBytes;
+}
+
+void freePools() {
+  while (pages != NULL) {
+    PoolPage *page = pages;
+    pages = page->next;
+    free(page->bits);
+    munmap(page, POOL_PAGE_SIZE);
+  }
+  while (releasedCount > 0)
+    munmap(released[--releasedCount], POOL_PAGE_SIZE);
+  free(released);
+  released = NULL;
+  releasedCapacity = 0;
+  pageBytes = 0;
+
+  for (int i = 0; i < POOL_CLASSES; ++i) {
+    classes[i].freeList = NULL;
+    classes[i].bump = classes[i].bumpEnd = NULL;
+  }
+}
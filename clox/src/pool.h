@@ -0,0 +1,92 @@
+#ifndef LOX_POOL_H
+#define LOX_POOL_H
+
+#include "common.h"
+
+// Segregated size class allocator for GC objects.
+// Object sizes are rounded up to a multiple of POOL_GRANULE, each class
+// has its own free list carved from POOL_PAGE_SIZE pages. Pages are
+// only returned by a compact or freePools, a freed slot is reused by
+// the next object of the same class. Sizes above POOL_MAX_SIZE go to malloc.
+//
+// Pages are mapped POOL_PAGE_SIZE aligned and have bitmaps with a bit per
+// granule, the bitmaps are allocated apart from the page so the GC
+// can mark objects without writing to their pages, which then stay
+// shared copy-on-write with a forked process.
+//
+// An allocated bitmap tells which slots hold objects, a collector can
+// walk them from the bitmaps with a PoolCursor, without reading the
+// pages, and sweep a page writing only to the slots it frees.
+//
+// A compacting collect moves the pages aside with poolBeginCompact,
+// copies the live objects to new pages and poolEndCompact gives the
+// memory of the old pages back to the system with madvise, keeping
+// their addresses for new pages. Slots pinned in place keep their page.
+
+#define POOL_GRANULE   16
+#define POOL_MAX_SIZE  256
+#define POOL_PAGE_SIZE (64 * 1024)
+
+typedef enum {
+  POOL_MARK_BITS,
+  POOL_SCAN_BITS,
+  POOL_PIN_BITS, // slots that don't move in a compact
+  POOL_LIVE_BITS, // allocated slots
+  POOL_BITMAPS
+} PoolBitmap;
+
+typedef union PoolPage PoolPage;
+
+// walks the allocated slots of all pages, pages added after it began
+// are left out
+typedef struct {
+  PoolPage *page;
+  int word;      // next bitmap word of page
+  uint64_t bits; // slots of the last word not yet returned
+  bool unmarked; // only slots without POOL_MARK_BITS
+} PoolCursor;
+
+// get a slot of at least size bytes, exits on out of memory
+void *poolAlloc(size_t size);
+
+// give back slot, size must be the same as when allocated
+void poolFree(void *pointer, size_t size);
+
+// true when a slot of size is in a page and has bitmap bits
+bool poolInPage(size_t size);
+
+// the bit of slot in bitmap, slot must be in a page
+bool poolTestBit(void *pointer, PoolBitmap bitmap);
+
+// set the bit of slot atomically, returns whether it was set already
+bool poolSetBit(void *pointer, PoolBitmap bitmap);
+
+// clear bitmap in all pages
+void poolClearBits(PoolBitmap bitmap);
+
+// start a compact, new slots come from new pages until it ends,
+// freed slots of the old pages go with their page
+void poolBeginCompact();
+
+// release the old pages, pages with pinned slots are kept and their
+// other slots made free
+void poolEndCompact();
+
+// start a walk, unmarked leaves out the slots with a mark bit
+void poolWalkBegin(PoolCursor *cursor, bool unmarked);
+
+// next allocated slot, NULL when the walk is done or steps bitmap
+// words were looked at without finding one, steps NULL for no limit.
+// The slot returned last might be freed before the next call
+void *poolWalkNext(PoolCursor *cursor, int *steps);
+
+// true when every slot of the walk was returned
+bool poolWalkDone(PoolCursor *cursor);
+
+// bytes taken from the system by pages
+size_t poolPageBytes();
+
+// release all pages, every pooled slot is invalid afterwards
+void freePools();
+
+#endif // LOX_POOL_H
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "prefetch.h"
+#include "scanner.h"
+#include "module.h"
+
+typedef enum {
+  FETCH_QUEUED,
+  FETCH_READING,
+  FETCH_DONE,
+  FETCH_FAILED,
+  FETCH_TAKEN
+} FetchState;
+
+// one for each file seen, kept after it's taken so it isn't read again
+typedef struct Fetch {
+  char *canonical,
+       *source;
+  FetchState state;
+  struct Fetch *next,
+               *nextQueued;
+} Fetch;
+
+// everything below is guarded by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queuedCond = PTHREAD_COND_INITIALIZER,
+                      doneCond = PTHREAD_COND_INITIALIZER;
+static pthread_t *workers = NULL;
+static int workerCount = 0;
+static bool stopping = false;
+static Fetch *fetches = NULL,
+             *queueHead = NULL,
+             *queueTail = NULL;
+
+// ------------------------------------------------------
+
+static Fetch *findFetch(const char *canonical) {
+  for (Fetch *fetch = fetches; fetch != NULL; fetch = fetch->next) {
+    if (strcmp(fetch->canonical, canonical) == 0)
+      return fetch;
+  }
+  return NULL;
+}
+
+// plain malloc, workers must not use the GC heap allocator
+static char *readSource(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  char *buffer = NULL;
+  if (fseek(file, 0L, SEEK_END) == 0) {
+    long fileSize = ftell(file);
+    rewind(file);
+    if (fileSize >= 0 && (buffer = malloc(fileSize +1)) != NULL) {
+      size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+      buffer[bytesRead] = '\0';
+    }
+  }
+
+  fclose(file);
+  return buffer;
+}
+
+// queue all 'import {...} from "path";' found in source
+static void queueImports(const char *source) {
+  Scanner scanner;
+  initScanner(&scanner, source);
+
+  bool inImport = false;
+  for (Token tok = scanToken(&scanner); tok.type != TOKEN_EOF;
+       tok = scanToken(&scanner))
+  {
+    if (tok.type == TOKEN_IMPORT) {
+      inImport = true;
+    } else if (inImport && tok.type == TOKEN_FROM) {
+      tok = scanToken(&scanner);
+      if (tok.type == TOKEN_STRING && tok.length > 2 &&
+          tok.length -2 < PATH_MAX)
+      {
+        char path[PATH_MAX];
+        memcpy(path, tok.start +1, tok.length -2);
+        path[tok.length -2] = '\0';
+        prefetchSource(path);
+      }
+      inImport = false;
+    }
+  }
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (queueHead == NULL && !stopping)
+      pthread_cond_wait(&queuedCond, &lock);
+    if (stopping) break;
+
+    Fetch *fetch = queueHead;
+    queueHead = fetch->nextQueued;
+    if (queueHead == NULL) queueTail = NULL;
+    // main thread took it over while it was queued
+    if (fetch->state != FETCH_QUEUED) continue;
+
+    fetch->state = FETCH_READING;
+    pthread_mutex_unlock(&lock);
+
+    char *source = readSource(fetch->canonical);
+    if (source != NULL)
+      queueImports(source);
+
+    pthread_mutex_lock(&lock);
+    fetch->source = source;
+    fetch->state = source != NULL ? FETCH_DONE : FETCH_FAILED;
+    pthread_cond_broadcast(&doneCond);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// ------------------------------------------------------
+
+void initPrefetch(int threads) {
+  if (threads < 1 || workerCount > 0) return;
+
+  stopping = false;
+  workers = malloc(sizeof(pthread_t) * threads);
+  if (workers == NULL) return;
+
+  for (int i = 0; i < threads; ++i) {
+    if (pthread_create(&workers[workerCount], NULL, worker, NULL) != 0)
+      break;
+    ++workerCount;
+  }
+}
+
+void freePrefetch() {
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&queuedCond);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < workerCount; ++i)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  workers = NULL;
+  workerCount = 0;
+
+  while (fetches != NULL) {
+    Fetch *fetch = fetches;
+    fetches = fetch->next;
+    free(fetch->canonical);
+    free(fetch->source);
+    free(fetch);
+  }
+  queueHead = queueTail = NULL;
+}
+
+void prefetchSource(const char *path) {
+  if (workerCount == 0) return;
+
+  char canonical[PATH_MAX];
+  if (!canonicalModulePath(path, canonical)) return;
+
+  pthread_mutex_lock(&lock);
+  if (!stopping && findFetch(canonical) == NULL) {
+    Fetch *fetch = malloc(sizeof(Fetch));
+    if (fetch != NULL && (fetch->canonical = strdup(canonical)) != NULL) {
+      fetch->source = NULL;
+      fetch->state = FETCH_QUEUED;
+      fetch->next = fetches;
+      fetch->nextQueued = NULL;
+      fetches = fetch;
+      if (queueTail != NULL) queueTail->nextQueued = fetch;
+      else queueHead = fetch;
+      queueTail = fetch;
+      pthread_cond_signal(&queuedCond);
+    } else
+      free(fetch);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+char *takePrefetchedSource(const char *canonicalPath) {
+  if (workerCount == 0) return NULL;
+
+  char *source = NULL;
+  pthread_mutex_lock(&lock);
+  Fetch *fetch = findFetch(canonicalPath);
+  if (fetch != NULL) {
+    // wait for a read in progress, but reading a queued one
+    // ourself is faster than waiting for its turn
+    while (fetch->state == FETCH_READING)
+      pthread_cond_wait(&doneCond, &lock);
+
+    if (fetch->state == FETCH_DONE)
+      source = fetch->source;
+    fetch->source = NULL;
+    fetch->state = FETCH_TAKEN;
+  }
+  pthread_mutex_unlock(&lock);
+  return source;
+}
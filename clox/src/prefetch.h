@@ -0,0 +1,32 @@
+#ifndef LOX_PREFETCH_H
+#define LOX_PREFETCH_H
+
+#include "common.h"
+
+// A small thread pool that reads import sources ahead of the
+// OP_IMPORT_MODULE that needs them. Each fetched source is scanned
+// (by its own Scanner) for imports, which are queued in turn, so a
+// wide import graph is read in parallel while the main thread keeps
+// compiling and running.
+//
+// Workers never touch the GC heap or the VM. Compiling stays on the
+// main thread as it allocates objects and interns strings, and the
+// functions being compiled are GC roots through the parser chain in
+// compiler.c, so only reading and scanning for imports is parallel.
+
+// start worker threads, threads < 1 disables prefetching
+void initPrefetch(int threads);
+
+// stop and join workers, frees sources not taken
+void freePrefetch();
+
+// queue path to be read in the background, path as written in the
+// import, resolved by canonicalModulePath like the loader does
+void prefetchSource(const char *path);
+
+// get source read in background for canonical (realpath) path
+// waits if it is still being read, NULL if not prefetched or failed
+// reciever takes ownership, free with free()
+char *takePrefetchedSource(const char *canonicalPath);
+
+#endif // LOX_PREFETCH_H
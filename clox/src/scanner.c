@@ -1,90 +1,62 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "common.h"
 #include "scanner.h"
-#include "memory.h"
-
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
-
-typedef struct StashScanner {
-  Scanner scanner;
-  struct StashScanner *next;
-} StashScanner;
-
-StashScanner *stashStack = NULL;
-
-Scanner scanner;
 
 // ------------------------------------------------------------
 
-static bool isAtEnd() {
-  return *scanner.current == '\0';
+static bool isAtEnd(Scanner *scanner) {
+  return *scanner->current == '\0';
 }
 
-static char advance() {
-  scanner.current++;
-  return scanner.current[-1];
-}
-
-Token scanPeek(uint8_t distance) {
-  const char *oldCur = scanner.current,
-             *oldStart = scanner.start;
-  int oldLine = scanner.line;
-
-  for (int i = 0; i < distance-1 && !isAtEnd(); ++i)
-    scanToken();
-  Token tok = scanToken();
-
-  scanner.current = oldCur;
-  scanner.start = oldStart;
-  scanner.line = oldLine;
-
-  return tok;
+static char advance(Scanner *scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner *scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
   return token;
 }
 
-static Token makeTokenAdvance(TokenType type, int moveFw) {
-  while (moveFw-- > 0) scanner.current++;
-  return makeToken(type);
+static Token makeTokenAdvance(Scanner *scanner, TokenType type, int moveFw) {
+  while (moveFw-- > 0) scanner->current++;
+  return makeToken(scanner, type);
 }
 
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner *scanner, const char *message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
 
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
-  scanner.current++;
+static bool match(Scanner *scanner, char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (*scanner->current != expected) return false;
+  scanner->current++;
   return true;
 }
 
-static char peek() {
-  return *scanner.current;
+static char peek(Scanner *scanner) {
+  return *scanner->current;
 }
 
-static char peekNext() {
-  if (isAtEnd()) return '\0';
-  return scanner.current[1];
+static char peekNext(Scanner *scanner) {
+  if (isAtEnd(scanner)) return '\0';
+  return scanner->current[1];
 }
 
 static bool isDigit(char c) {
@@ -97,39 +69,193 @@ static bool isAlpha(char c) {
           c == '_';
 }
 
-static const char *skipWhitespace() {
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isAligned(const char *p) {
+  return ((uintptr_t)p & 15) == 0;
+}
+
+// The span* functions below find the end of a run of chars 16 at a time
+// using SSE2 (always there on x86_64), with a scalar loop for the
+// unaligned head and for other targets.
+// Only aligned loads are used, they never cross a page boundary so
+// reading past the '\0' terminator can't fault, same as libc's strlen.
+
+// the overread is deliberate, don't let ASan report it
+#if defined(__SANITIZE_ADDRESS__)
+# define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+# define NO_SANITIZE_ADDRESS
+#endif
+
+#ifdef __SSE2__
+// bitmask of bytes in chunk >= lo and <= hi
+static inline __m128i inRange(__m128i chunk, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(lo -1)),
+                       _mm_cmplt_epi8(chunk, _mm_set1_epi8(hi +1)));
+}
+
+static inline __m128i isByte(__m128i chunk, char c) {
+  return _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c));
+}
+
+// bit i set for each byte i that ends the run
+static inline unsigned stopMask(__m128i inRun) {
+  return ~_mm_movemask_epi8(inRun) & 0xFFFF;
+}
+
+// count newlines before bit stop in lines
+static inline int linesBefore(unsigned lines, unsigned stop) {
+  return __builtin_popcount(lines & ((stop & -stop) -1));
+}
+#endif
+
+// skip spaces, tabs and newlines, counting lines on the way
+NO_SANITIZE_ADDRESS
+static void skipBlanks(Scanner *scanner) {
+  const char *p = scanner->current;
+#ifdef __SSE2__
+  for (; !isAligned(p) && isBlank(*p); ++p)
+    if (*p == '\n') scanner->line++;
+
+  for (; isAligned(p); p += 16) {
+    __m128i chunk = _mm_load_si128((const __m128i*)p),
+            nl = isByte(chunk, '\n');
+    __m128i blank = _mm_or_si128(
+      _mm_or_si128(isByte(chunk, ' '), isByte(chunk, '\t')),
+      _mm_or_si128(isByte(chunk, '\r'), nl));
+    unsigned stop = stopMask(blank),
+             lines = _mm_movemask_epi8(nl);
+    if (stop) {
+      scanner->line += linesBefore(lines, stop);
+      p += __builtin_ctz(stop);
+      break;
+    }
+    scanner->line += __builtin_popcount(lines);
+  }
+#endif
+  for (; isBlank(*p); ++p)
+    if (*p == '\n') scanner->line++;
+  scanner->current = p;
+}
+
+// returns end of a '//' comment, the '\n' or the terminator
+NO_SANITIZE_ADDRESS
+static const char *spanLineComment(const char *p) {
+#ifdef __SSE2__
+  for (; !isAligned(p) && *p != '\n' && *p != '\0'; ++p) ;
+
+  for (; isAligned(p); p += 16) {
+    __m128i chunk = _mm_load_si128((const __m128i*)p);
+    unsigned stop = _mm_movemask_epi8(
+      _mm_or_si128(isByte(chunk, '\n'), isByte(chunk, '\0')));
+    if (stop) return p + __builtin_ctz(stop);
+  }
+#endif
+  for (; *p != '\n' && *p != '\0'; ++p) ;
+  return p;
+}
+
+// returns end of identifier chars [a-zA-Z0-9_]
+NO_SANITIZE_ADDRESS
+static const char *spanIdentifier(const char *p) {
+#ifdef __SSE2__
+  for (; !isAligned(p) && (isAlpha(*p) || isDigit(*p)); ++p) ;
+
+  for (; isAligned(p); p += 16) {
+    __m128i chunk = _mm_load_si128((const __m128i*)p),
+            lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+    unsigned stop = stopMask(_mm_or_si128(
+      _mm_or_si128(inRange(lower, 'a', 'z'), inRange(chunk, '0', '9')),
+      isByte(chunk, '_')));
+    if (stop) return p + __builtin_ctz(stop);
+  }
+#endif
+  for (; isAlpha(*p) || isDigit(*p); ++p) ;
+  return p;
+}
+
+// returns end of a run of digits
+NO_SANITIZE_ADDRESS
+static const char *spanDigits(const char *p) {
+#ifdef __SSE2__
+  for (; !isAligned(p) && isDigit(*p); ++p) ;
+
+  for (; isAligned(p); p += 16) {
+    __m128i chunk = _mm_load_si128((const __m128i*)p);
+    unsigned stop = stopMask(inRange(chunk, '0', '9'));
+    if (stop) return p + __builtin_ctz(stop);
+  }
+#endif
+  for (; isDigit(*p); ++p) ;
+  return p;
+}
+
+// advance to next '"', '\' or the terminator in a string literal,
+// counting lines on the way
+NO_SANITIZE_ADDRESS
+static void spanString(Scanner *scanner) {
+  const char *p = scanner->current;
+#ifdef __SSE2__
+  for (; !isAligned(p) && *p != '"' && *p != '\\' && *p != '\0'; ++p)
+    if (*p == '\n') scanner->line++;
+
+  for (; isAligned(p); p += 16) {
+    __m128i chunk = _mm_load_si128((const __m128i*)p);
+    unsigned stop = _mm_movemask_epi8(_mm_or_si128(
+      _mm_or_si128(isByte(chunk, '"'), isByte(chunk, '\\')),
+      isByte(chunk, '\0')));
+    unsigned lines = _mm_movemask_epi8(isByte(chunk, '\n'));
+    if (stop) {
+      scanner->line += linesBefore(lines, stop);
+      p += __builtin_ctz(stop);
+      break;
+    }
+    scanner->line += __builtin_popcount(lines);
+  }
+#endif
+  for (; *p != '"' && *p != '\\' && *p != '\0'; ++p)
+    if (*p == '\n') scanner->line++;
+  scanner->current = p;
+}
+
+static const char *skipWhitespace(Scanner *scanner) {
   for (;;) {
-    char c = peek();
+    char c = peek(scanner);
     switch (c) {
-    case ' ': case '\r': case '\t':
-      advance(); break;
     case '\n':
-      scanner.line++;
-      advance(); break;
+      scanner->line++;
+      // fall through
+    case ' ': case '\r': case '\t':
+      advance(scanner);
+      // most often a single space between tokens, only span runs
+      if (isBlank(peek(scanner))) skipBlanks(scanner);
+      break;
     case '/':
-      if (peekNext() == '/') {
+      if (peekNext(scanner) == '/') {
         // a comment
-        while (peek() != '\n' && !isAtEnd())
-          advance();
+        scanner->current = spanLineComment(scanner->current);
         break; // switch
-      } else if (peekNext() == '*') {
-        char prev = advance(); // the '*' in /*
-        int nestCount = 0, startLine = scanner.line;
-        const char *startPos = scanner.current+1;
+      } else if (peekNext(scanner) == '*') {
+        char prev = advance(scanner); // the '*' in /*
+        int nestCount = 0, startLine = scanner->line;
+        const char *startPos = scanner->current+1;
         do {
           prev = c;
-          c = advance();
-          if (c == '\n') scanner.line++;
+          c = advance(scanner);
+          if (c == '\n') scanner->line++;
           else if (prev == '/' && c == '*')
             ++nestCount;
           else if (prev == '*' && c == '/')
             --nestCount;
-          else if (isAtEnd()) {
-            scanner.current = startPos;
-            scanner.line = startLine;
+          else if (isAtEnd(scanner)) {
+            scanner->current = startPos;
+            scanner->line = startLine;
             return "Unmatched '/*'.";
           }
-        } while (nestCount > 0 && !isAtEnd());
+        } while (nestCount > 0 && !isAtEnd(scanner));
         break; // switch
       } else
         return NULL;
@@ -138,203 +264,197 @@ static const char *skipWhitespace() {
   }
 }
 
-static Token string() {
-  char c;
-  while((c = peek()) != '"' && !isAtEnd()) {
-    switch(c) {
-    case '\n': ++scanner.line; advance(); break;
-    case '\\':
-      if (peekNext() == '"') scanner.current += 2;
-      // fall through
-    default: advance();
-    }
+static Token string(Scanner *scanner) {
+  for (;;) {
+    spanString(scanner);
+    if (peek(scanner) != '\\') break;
+    // an escape, skip it and the escaped char
+    advance(scanner);
+    if (isAtEnd(scanner)) break;
+    if (advance(scanner) == '\n') ++scanner->line;
   }
 
-  if (isAtEnd()) return errorToken("Unterminated string.");
+  if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
   // the closing quote
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
 
-static Token number() {
-  while (isDigit(peek())) advance();
+static Token number(Scanner *scanner) {
+  scanner->current = spanDigits(scanner->current);
 
   // fractional part
-  if (peek() == '.' && isDigit(peekNext())) {
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
     //consume '.'
-    advance();
+    advance(scanner);
 
-    while (isDigit(peek())) advance();
+    scanner->current = spanDigits(scanner->current);
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static TokenType checkKeyword(int start, int length,
-                    const char *rest, TokenType type)
-{
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0)
-  {
-    return type;
-  }
+typedef struct {
+  const char *name;
+  int length;
+  TokenType type;
+} Keyword;
+
+// perfect hash of all keywords, slot is given by keywordHash,
+// generated by searching multipliers until no keywords collide
+#define KEYWORD_SLOTS 64
+static const Keyword keywordTable[KEYWORD_SLOTS] = {
+  [0]  = {"false", 5, TOKEN_FALSE},
+  [2]  = {"export", 6, TOKEN_EXPORT},
+  [12] = {"this", 4, TOKEN_THIS},
+  [17] = {"and", 3, TOKEN_AND},
+  [20] = {"or", 2, TOKEN_OR},
+  [21] = {"class", 5, TOKEN_CLASS},
+  [24] = {"if", 2, TOKEN_IF},
+  [25] = {"while", 5, TOKEN_WHILE},
+  [27] = {"print", 5, TOKEN_PRINT},
+  [28] = {"else", 4, TOKEN_ELSE},
+  [31] = {"as", 2, TOKEN_AS},
+  [33] = {"continue", 8, TOKEN_CONTINUE},
+  [35] = {"break", 5, TOKEN_BREAK},
+  [40] = {"for", 3, TOKEN_FOR},
+  [42] = {"true", 4, TOKEN_TRUE},
+  [48] = {"super", 5, TOKEN_SUPER},
+  [49] = {"import", 6, TOKEN_IMPORT},
+  [50] = {"from", 4, TOKEN_FROM},
+  [54] = {"nil", 3, TOKEN_NIL},
+  [58] = {"fun", 3, TOKEN_FUN},
+  [61] = {"return", 6, TOKEN_RETURN},
+  [62] = {"var", 3, TOKEN_VAR},
+};
 
-  return TOKEN_IDENTIFIER;
+// all keywords are 2 to 8 chars, caller checks length
+static inline int keywordHash(const char *start, int length) {
+  return ((uint8_t)start[0] * 4 + (uint8_t)start[1] * 3 + length) &
+           (KEYWORD_SLOTS -1);
 }
 
-static TokenType identifierType() {
-  switch (scanner.start[0]) {
-  case 'a':
-    if (scanner.current - scanner.start > 1 &&
-        scanner.start[1] == 's') return TOKEN_AS;
-    else return checkKeyword(1, 2, "nd", TOKEN_AND);
-  case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-  case 'c':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-      case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-      default: break;
-      }
-    }
-  case 'e':
-    if (scanner.current - scanner.start > 1 &&
-        scanner.start[1] == 'x')
-      return checkKeyword(2, 4, "port", TOKEN_EXPORT);
-    else return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-  case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-      case 'r': return checkKeyword(2, 2, "om", TOKEN_FROM);
-      case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-      case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-      default: break;
-      }
-    }
-    break;
-  case 'i':
-    if (scanner.current - scanner.start > 1 &&
-        scanner.start[1] == 'm')
-        return checkKeyword(2, 4, "port", TOKEN_IMPORT);
-    else return checkKeyword(1, 1, "f", TOKEN_IF);
-  case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-  case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-  case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-  case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-  case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-      case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-      default: break;
-      }
-    }
-    break;
-  case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-  case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-  default: break;
-  }
+static TokenType identifierType(Scanner *scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  if (length < 2 || length > 8) return TOKEN_IDENTIFIER;
+
+  const Keyword *keyword =
+    &keywordTable[keywordHash(scanner->start, length)];
+  if (keyword->length == length &&
+      memcmp(scanner->start, keyword->name, length) == 0)
+    return keyword->type;
+
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-  while(isAlpha(peek()) || isDigit(peek())) advance();
-  return makeToken(identifierType());
+static Token identifier(Scanner *scanner) {
+  scanner->current = spanIdentifier(scanner->current);
+  return makeToken(scanner, identifierType(scanner));
 }
 
-// ------------------------------------------------------------
-
-
-void initScanner(const char *source) {
-  scanner.start = scanner.current = source;
-  scanner.line = 1;
+// scan until count tokens are buffered
+static void fillTokens(TokenStream *stream, int count) {
+  while (stream->count < count) {
+    int idx = (stream->head + stream->count) & (TOKEN_LOOKAHEAD -1);
+    stream->tokens[idx] = scanToken(&stream->scanner);
+    stream->count++;
+  }
 }
 
-void scannerStashPush() {
-  StashScanner **prev = &stashStack;
-  while (*prev != NULL)
-    *prev = (*prev)->next;
-
-  *prev = ALLOCATE(StashScanner, 1);
-  memcpy(&(*prev)->scanner, &scanner, sizeof(scanner));
-  (*prev)->next = NULL;
-}
+// ------------------------------------------------------------
 
-bool scannerStashPop() {
-  if (stashStack == NULL) return false;
 
-  StashScanner  **stsh = &stashStack,
-                **prev = &stashStack;
-  while (*stsh != NULL && (*stsh)->next != NULL) {
-    *prev = *stsh;
-    *stsh = (*stsh)->next;
-  }
-  if (*prev != stashStack)
-    prev = &(*prev)->next;
+void initScanner(Scanner *scanner, const char *source) {
+  initScannerAtLine(scanner, source, 1);
+}
 
-  memcpy(&scanner, &(*stsh)->scanner, sizeof(scanner));
-  FREE(StashScanner, *stsh);
-  *prev = NULL;
-  return true;
+void initScannerAtLine(Scanner *scanner, const char *source, int line) {
+  scanner->start = scanner->current = source;
+  scanner->line = line;
 }
 
-Token scanToken() {
-  const char *failMsg = skipWhitespace();
+Token scanToken(Scanner *scanner) {
+  const char *failMsg = skipWhitespace(scanner);
   if (failMsg != NULL)
-    return errorToken(failMsg);
+    return errorToken(scanner, failMsg);
 
-  scanner.start = scanner.current;
+  scanner->start = scanner->current;
 
-  if (isAtEnd()) return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-  char c = advance();
+  char c = advance(scanner);
 
-  if (isAlpha(c)) return identifier();
-  if (isDigit(c)) return number();
+  if (isAlpha(c)) return identifier(scanner);
+  if (isDigit(c)) return number(scanner);
 
   switch(c) {
-  case '(': return makeToken(TOKEN_LEFT_PAREN);
-  case ')': return makeToken(TOKEN_RIGHT_PAREN);
-  case '{': return makeToken(TOKEN_LEFT_BRACE);
-  case '}': return makeToken(TOKEN_RIGHT_BRACE);
-  case '[': return makeToken(TOKEN_LEFT_BRACKET);
-  case ']': return makeToken(TOKEN_RIGHT_BRACKET);
-  case ':': return makeToken(TOKEN_COLON);
-  case ';': return makeToken(TOKEN_SEMICOLON);
-  case ',': return makeToken(TOKEN_COMMA);
-  case '.': return makeToken(TOKEN_DOT);
+  case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+  case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+  case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+  case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+  case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+  case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+  case ':': return makeToken(scanner, TOKEN_COLON);
+  case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+  case ',': return makeToken(scanner, TOKEN_COMMA);
+  case '.': return makeToken(scanner, TOKEN_DOT);
   case '-':
-    if (peek() == '=') return makeTokenAdvance(TOKEN_MINUS_EQUAL, 1);
-    else return makeToken(TOKEN_MINUS);
+    if (peek(scanner) == '=')
+      return makeTokenAdvance(scanner, TOKEN_MINUS_EQUAL, 1);
+    else return makeToken(scanner, TOKEN_MINUS);
   case '+':
-    if (peek() == '=') return makeTokenAdvance(TOKEN_PLUS_EQUAL, 1);
-    else return makeToken(TOKEN_PLUS);
+    if (peek(scanner) == '=')
+      return makeTokenAdvance(scanner, TOKEN_PLUS_EQUAL, 1);
+    else return makeToken(scanner, TOKEN_PLUS);
   case '*':
-    if (peek() == '=') return makeTokenAdvance(TOKEN_STAR_EQUAL, 1);
-    else return makeToken(TOKEN_STAR);
+    if (peek(scanner) == '=')
+      return makeTokenAdvance(scanner, TOKEN_STAR_EQUAL, 1);
+    else return makeToken(scanner, TOKEN_STAR);
   case '/':
-    if (peek() == '=') return makeTokenAdvance(TOKEN_SLASH_EQUAL, 1);
-    else return makeToken(TOKEN_SLASH);
+    if (peek(scanner) == '=')
+      return makeTokenAdvance(scanner, TOKEN_SLASH_EQUAL, 1);
+    else return makeToken(scanner, TOKEN_SLASH);
   case '!':
-    return makeToken(
-      match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    return makeToken(scanner, 
+      match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
   case '=':
-    return makeToken(
-      match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    return makeToken(scanner, 
+      match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
   case '<':
-    return makeToken(
-      match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    return makeToken(scanner, 
+      match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
   case '>':
-    return makeToken(
-      match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-  case '"': return string();
+    return makeToken(scanner, 
+      match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+  case '"': return string(scanner);
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
+}
+
+void initTokenStream(TokenStream *stream, const char *source, int line) {
+  initScannerAtLine(&stream->scanner, source, line);
+  stream->head = stream->count = 0;
+}
+
+Token nextToken(TokenStream *stream) {
+  // nothing peeked, the usual case, skip the ring
+  if (stream->count == 0)
+    return scanToken(&stream->scanner);
+
+  Token token = stream->tokens[stream->head];
+  stream->head = (stream->head +1) & (TOKEN_LOOKAHEAD -1);
+  stream->count--;
+  return token;
+}
+
+Token peekToken(TokenStream *stream, uint8_t distance) {
+  if (distance < 1) distance = 1;
+  else if (distance > TOKEN_LOOKAHEAD) distance = TOKEN_LOOKAHEAD;
+  fillTokens(stream, distance);
+  return stream->tokens[(stream->head + distance -1) & (TOKEN_LOOKAHEAD -1)];
 }
 
 const char *keywords[] = {
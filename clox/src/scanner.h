@@ -36,16 +36,39 @@ typedef struct {
       line;
 } Token;
 
+// scanner state, each compile (or thread) owns its own
+typedef struct Scanner {
+  const char *start;
+  const char *current;
+  int line;
+} Scanner;
+
+// how far a TokenStream can look ahead, must be a power of 2
+#define TOKEN_LOOKAHEAD 4
+
+// buffered scanner, tokens are scanned once into a ring and
+// handed out from there, so peeking ahead doesn't rescan
+typedef struct TokenStream {
+  Scanner scanner;
+  Token tokens[TOKEN_LOOKAHEAD];
+  uint8_t head,  // next token to be returned
+          count; // tokens scanned but not yet returned
+} TokenStream;
+
 // initalize scanner
-void initScanner(const char *source);
+void initScanner(Scanner *scanner, const char *source);
+// initalize scanner to start at line, used when source is a part of a file
+void initScannerAtLine(Scanner *scanner, const char *source, int line);
 // scan next token
-Token scanToken();
-// save state of current scanner
-void scannerStashPush();
-// restore scanner to saved state
-bool scannerStashPop();
-// peek forward, but don't advance
-Token scanPeek(uint8_t distance);
+Token scanToken(Scanner *scanner);
+
+// initialize stream to scan source starting at line
+void initTokenStream(TokenStream *stream, const char *source, int line);
+// return next token, from the buffer if it's already peeked
+Token nextToken(TokenStream *stream);
+// peek forward, but don't advance, 1 is the token nextToken returns
+// distance is clamped to 1..TOKEN_LOOKAHEAD
+Token peekToken(TokenStream *stream, uint8_t distance);
 
 extern const char *keywords[];
 extern const size_t keywordCnt;
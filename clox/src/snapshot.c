@@ -0,0 +1,845 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "memory.h"
+#include "object.h"
+#include "compiler.h"
+#include "module.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC     "CLOXSNAP"
+#define SNAPSHOT_VERSION   2
+#define SNAPSHOT_BYTEORDER 0x01020304u
+
+// tags for Values in snapshot
+typedef enum {
+  SNAP_NIL,
+  SNAP_FALSE,
+  SNAP_TRUE,
+  SNAP_NUMBER,
+  SNAP_OBJ
+} SnapValueTag;
+
+// how a local name token is stored
+typedef enum {
+  SNAP_TOK_SOURCE, // offset into module source
+  SNAP_TOK_THIS,
+  SNAP_TOK_SUPER,
+  SNAP_TOK_EMPTY
+} SnapTokenKind;
+
+// maps a object pointer to its index in snapshot
+typedef struct ObjIndex {
+  Obj **keys;
+  uint32_t *values;
+  int count,
+      capacity;
+} ObjIndex;
+
+typedef struct Writer {
+  FILE *file;
+  ObjIndex index;
+  Obj **objects;
+  int objectCount,
+      objectCapacity;
+  Module **modules;
+  size_t *sourceLens;
+  int moduleCount;
+} Writer;
+
+typedef struct Reader {
+  const uint8_t *pos,
+                *end;
+  bool failed;
+} Reader;
+
+typedef struct RestoreState {
+  Module **modules;
+  int moduleCount;
+  Obj **objects;
+  const uint8_t **payloads;
+  uint8_t *types;
+  uint32_t objectCount;
+} RestoreState;
+
+static Writer writer;
+
+// --------------------------------------------------------------
+// pointer to index map
+
+static uint32_t hashPointer(Obj *obj) {
+  uintptr_t p = (uintptr_t)obj >> 3;
+  return (uint32_t)(p * 2654435761u);
+}
+
+static void indexAdjust(ObjIndex *index, int capacity) {
+  Obj **keys = ALLOCATE(Obj*, capacity);
+  uint32_t *values = ALLOCATE(uint32_t, capacity);
+  for (int i = 0; i < capacity; ++i)
+    keys[i] = NULL;
+
+  for (int i = 0; i < index->capacity; ++i) {
+    if (index->keys[i] == NULL) continue;
+    uint32_t slot = hashPointer(index->keys[i]) & (capacity -1);
+    while (keys[slot] != NULL)
+      slot = (slot +1) & (capacity -1);
+    keys[slot] = index->keys[i];
+    values[slot] = index->values[i];
+  }
+
+  FREE_ARRAY(Obj*, index->keys, index->capacity);
+  FREE_ARRAY(uint32_t, index->values, index->capacity);
+  index->keys = keys;
+  index->values = values;
+  index->capacity = capacity;
+}
+
+// returns index +1 or 0 if not found
+static uint32_t indexGet(ObjIndex *index, Obj *obj) {
+  if (index->count == 0) return 0;
+  uint32_t slot = hashPointer(obj) & (index->capacity -1);
+  while (index->keys[slot] != NULL) {
+    if (index->keys[slot] == obj) return index->values[slot];
+    slot = (slot +1) & (index->capacity -1);
+  }
+  return 0;
+}
+
+static void indexSet(ObjIndex *index, Obj *obj, uint32_t value) {
+  if (index->count +1 > index->capacity * 0.5)
+    indexAdjust(index, GROW_CAPACITY(index->capacity));
+
+  uint32_t slot = hashPointer(obj) & (index->capacity -1);
+  while (index->keys[slot] != NULL)
+    slot = (slot +1) & (index->capacity -1);
+  index->keys[slot] = obj;
+  index->values[slot] = value;
+  index->count++;
+}
+
+// --------------------------------------------------------------
+// writer
+
+static void writeBytes(const void *bytes, size_t len) {
+  fwrite(bytes, 1, len, writer.file);
+}
+
+static void writeU8(uint8_t vlu)   { writeBytes(&vlu, sizeof(vlu)); }
+static void writeU32(uint32_t vlu) { writeBytes(&vlu, sizeof(vlu)); }
+static void writeI32(int32_t vlu)  { writeBytes(&vlu, sizeof(vlu)); }
+static void writeI64(int64_t vlu)  { writeBytes(&vlu, sizeof(vlu)); }
+
+static int moduleIndex(Module *module) {
+  for (int i = 0; i < writer.moduleCount; ++i)
+    if (writer.modules[i] == module) return i +1;
+  return 0;
+}
+
+static bool isSerializable(Obj *obj) {
+  switch (obj->type) {
+  case OBJ_STRING: case OBJ_FUNCTION:
+  case OBJ_REFERENCE: case OBJ_NATIVE_FN:
+    return true;
+  case OBJ_MODULE:
+    return moduleIndex(((ObjModule*)obj)->module) > 0;
+  default:
+    return false;
+  }
+}
+
+static void addObject(Obj *obj) {
+  // a rope is written as the string it stands for
+  if (obj != NULL && obj->type == OBJ_ROPE)
+    obj = OBJ_CAST(flattenRope((ObjRope*)obj));
+  if (obj == NULL || !isSerializable(obj) ||
+      indexGet(&writer.index, obj) > 0)
+  {
+    return;
+  }
+
+  if (writer.objectCapacity < writer.objectCount +1) {
+    int oldCapacity = writer.objectCapacity;
+    writer.objectCapacity = GROW_CAPACITY(oldCapacity);
+    writer.objects = GROW_ARRAY(Obj*, writer.objects,
+                                oldCapacity, writer.objectCapacity);
+  }
+  writer.objects[writer.objectCount++] = obj;
+  indexSet(&writer.index, obj, writer.objectCount);
+}
+
+static void addValue(Value value) {
+  if (IS_OBJ(value)) addObject(AS_OBJ(value));
+}
+
+static void addTable(Table *table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry *entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    addObject(OBJ_CAST(entry->key));
+    addValue(entry->value);
+  }
+}
+
+// snapshot only stores compiled code, compile bodies that are
+// still only preparsed (lazy compile) before the graph is walked
+static bool compilePreparsed(Obj *obj) {
+  return obj->type != OBJ_FUNCTION ||
+         compileFunctionBody((ObjFunction*)obj);
+}
+
+// walks the object graph breadth first from roots
+static void collectObjects() {
+  addTable(&vm.strings);
+  addTable(&vm.globals);
+  for (int i = 0; i < writer.moduleCount; ++i) {
+    addObject(OBJ_CAST(writer.modules[i]->rootFunction));
+    addTable(&writer.modules[i]->exports);
+  }
+
+  for (int i = 0; i < writer.objectCount; ++i) {
+    Obj *obj = writer.objects[i];
+    switch (obj->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction*)obj;
+      addObject(OBJ_CAST(function->name));
+      for (int c = 0; c < function->chunk.constants.count; ++c)
+        addValue(function->chunk.constants.values[c]);
+      Compiler *compiler = function->chunk.compiler;
+      if (compiler != NULL && compiler->enclosing != NULL)
+        addObject(OBJ_CAST(compiler->enclosing->function));
+    } break;
+    case OBJ_REFERENCE: {
+      ObjReference *ref = (ObjReference*)obj;
+      addObject(OBJ_CAST(ref->name));
+      addObject(OBJ_CAST(ref->mod));
+    } break;
+    case OBJ_NATIVE_FN:
+      addObject(OBJ_CAST(((ObjNativeFn*)obj)->name));
+      break;
+    default: break;
+    }
+  }
+}
+
+static uint32_t objRef(Obj *obj) {
+  if (obj == NULL) return 0;
+  if (obj->type == OBJ_ROPE)
+    obj = OBJ_CAST(flattenRope((ObjRope*)obj));
+  return indexGet(&writer.index, obj);
+}
+
+static void writeValue(Value value) {
+  if (IS_NIL(value)) {
+    writeU8(SNAP_NIL);
+  } else if (IS_BOOL(value)) {
+    writeU8(AS_BOOL(value) ? SNAP_TRUE : SNAP_FALSE);
+  } else if (IS_NUMBER(value)) {
+    double num = AS_NUMBER(value);
+    writeU8(SNAP_NUMBER);
+    writeBytes(&num, sizeof(num));
+  } else {
+    uint32_t ref = objRef(AS_OBJ(value));
+    if (ref == 0) {
+      writeU8(SNAP_NIL);
+    } else {
+      writeU8(SNAP_OBJ);
+      writeU32(ref);
+    }
+  }
+}
+
+static void writeLocal(Local *local, Module *module) {
+  int modIdx = moduleIndex(module);
+  const char *src = modIdx > 0 ? module->source : NULL;
+  size_t srcLen = modIdx > 0 ? writer.sourceLens[modIdx -1] : 0;
+
+  if (src != NULL && local->name.start >= src &&
+      local->name.start < src + srcLen)
+  {
+    writeU8(SNAP_TOK_SOURCE);
+    writeU32((uint32_t)(local->name.start - src));
+  } else if (local->name.length == 4 &&
+             memcmp(local->name.start, "this", 4) == 0) {
+    writeU8(SNAP_TOK_THIS);
+    writeU32(0);
+  } else if (local->name.length == 5 &&
+             memcmp(local->name.start, "super", 5) == 0) {
+    writeU8(SNAP_TOK_SUPER);
+    writeU32(0);
+  } else {
+    writeU8(SNAP_TOK_EMPTY);
+    writeU32(0);
+  }
+  writeI32(local->name.type);
+  writeI32(local->name.length);
+  writeI32(local->name.line);
+  writeI32(local->depth);
+  writeU8(local->isCaptured);
+  writeU8(local->isReference);
+}
+
+static void writeFunction(ObjFunction *function) {
+  Compiler *compiler = function->chunk.compiler;
+  Chunk *chunk = &function->chunk;
+
+  writeU8(compiler != NULL);
+  writeI32(function->arity);
+  writeI32(function->upvalueCount);
+  writeU32(objRef(OBJ_CAST(function->name)));
+  writeU32(moduleIndex(chunk->module));
+
+  writeU32(chunk->count);
+  writeBytes(chunk->code, chunk->count);
+  writeU32(chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; ++i) {
+    writeI32(chunk->lines[i].offset);
+    writeI32(chunk->lines[i].line);
+  }
+  writeU32(chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; ++i)
+    writeValue(chunk->constants.values[i]);
+
+  if (compiler == NULL) return;
+
+  writeU8(compiler->type);
+  writeI32(compiler->localCount);
+  writeI32(compiler->scopeDepth);
+  writeU32(compiler->enclosing != NULL ?
+             objRef(OBJ_CAST(compiler->enclosing->function)) : 0);
+
+  uint32_t localsCnt = 0;
+  while (localsCnt < UINT8_COUNT &&
+         compiler->locals[localsCnt].name.start != NULL)
+  {
+    ++localsCnt;
+  }
+  writeU32(localsCnt);
+  for (uint32_t i = 0; i < localsCnt; ++i)
+    writeLocal(&compiler->locals[i], chunk->module);
+
+  for (int i = 0; i < function->upvalueCount; ++i) {
+    writeU8(compiler->upvalues[i].index);
+    writeU8(compiler->upvalues[i].isLocal);
+  }
+}
+
+// writes payload for object, format depends on type
+static void writeObjectPayload(Obj *obj) {
+  switch (obj->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString*)obj;
+    writeU32(string->length);
+    writeBytes(string->chars, string->length);
+  } break;
+  case OBJ_FUNCTION:
+    writeFunction((ObjFunction*)obj);
+    break;
+  case OBJ_REFERENCE: {
+    ObjReference *ref = (ObjReference*)obj;
+    // chunk always belongs to a function, store that function
+    ObjFunction *function = (ObjFunction*)(
+      (char*)ref->chunk - offsetof(ObjFunction, chunk));
+    writeU32(objRef(OBJ_CAST(ref->name)));
+    writeU32(objRef(OBJ_CAST(ref->mod)));
+    writeU32(objRef(OBJ_CAST(function)));
+    writeI32(ref->index);
+  } break;
+  case OBJ_MODULE:
+    writeU32(moduleIndex(((ObjModule*)obj)->module));
+    break;
+  case OBJ_NATIVE_FN:
+    writeU32(objRef(OBJ_CAST(((ObjNativeFn*)obj)->name)));
+    break;
+  default: break;
+  }
+}
+
+static void writeObject(Obj *obj) {
+  writeU8(obj->type);
+  // size is patched when payload is written
+  long sizePos = ftell(writer.file);
+  writeU32(0);
+  writeObjectPayload(obj);
+  long endPos = ftell(writer.file);
+  fseek(writer.file, sizePos, SEEK_SET);
+  writeU32((uint32_t)(endPos - sizePos - sizeof(uint32_t)));
+  fseek(writer.file, endPos, SEEK_SET);
+}
+
+static void writeTable(Table *table) {
+  uint32_t count = 0;
+  for (int i = 0; i < table->capacity; ++i)
+    if (objRef(OBJ_CAST(table->entries[i].key)) > 0) ++count;
+
+  writeU32(count);
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry *entry = &table->entries[i];
+    uint32_t key = objRef(OBJ_CAST(entry->key));
+    if (key == 0) continue;
+    writeU32(key);
+    writeValue(entry->value);
+  }
+}
+
+static void writeModuleHeader(Module *module, size_t sourceLen) {
+  struct stat st;
+  if (stat(module->path->chars, &st) != 0) {
+    st.st_mtime = 0;
+    st.st_size = -1;
+  }
+
+  writeU32(module->name->length);
+  writeBytes(module->name->chars, module->name->length);
+  writeU32(module->path->length);
+  writeBytes(module->path->chars, module->path->length);
+  writeI64((int64_t)st.st_mtime);
+  writeI64((int64_t)st.st_size);
+  writeI64((int64_t)sourceLen);
+  writeBytes(module->source, sourceLen);
+}
+
+static void freeWriter() {
+  FREE_ARRAY(Obj*, writer.index.keys, writer.index.capacity);
+  FREE_ARRAY(uint32_t, writer.index.values, writer.index.capacity);
+  FREE_ARRAY(Obj*, writer.objects, writer.objectCapacity);
+  FREE_ARRAY(Module*, writer.modules, writer.moduleCount);
+  FREE_ARRAY(size_t, writer.sourceLens, writer.moduleCount);
+  memset(&writer, 0, sizeof(writer));
+}
+
+// --------------------------------------------------------------
+// reader
+
+static void readBytes(Reader *reader, void *to, size_t len) {
+  if (reader->failed || (size_t)(reader->end - reader->pos) < len) {
+    reader->failed = true;
+    memset(to, 0, len);
+    return;
+  }
+  memcpy(to, reader->pos, len);
+  reader->pos += len;
+}
+
+// returns pointer into buffer and moves past len bytes
+static const uint8_t *skipBytes(Reader *reader, size_t len) {
+  if (reader->failed || (size_t)(reader->end - reader->pos) < len) {
+    reader->failed = true;
+    return NULL;
+  }
+  const uint8_t *start = reader->pos;
+  reader->pos += len;
+  return start;
+}
+
+static uint8_t readU8(Reader *reader) {
+  uint8_t vlu; readBytes(reader, &vlu, sizeof(vlu)); return vlu;
+}
+static uint32_t readU32(Reader *reader) {
+  uint32_t vlu; readBytes(reader, &vlu, sizeof(vlu)); return vlu;
+}
+static int32_t readI32(Reader *reader) {
+  int32_t vlu; readBytes(reader, &vlu, sizeof(vlu)); return vlu;
+}
+static int64_t readI64(Reader *reader) {
+  int64_t vlu; readBytes(reader, &vlu, sizeof(vlu)); return vlu;
+}
+
+static Obj *readRef(Reader *reader, RestoreState *state) {
+  uint32_t ref = readU32(reader);
+  if (ref == 0 || ref > state->objectCount) return NULL;
+  return state->objects[ref -1];
+}
+
+static Module *readModuleRef(Reader *reader, RestoreState *state) {
+  uint32_t idx = readU32(reader);
+  if (idx == 0 || (int)idx > state->moduleCount) return NULL;
+  return state->modules[idx -1];
+}
+
+static Value readValue(Reader *reader, RestoreState *state) {
+  switch (readU8(reader)) {
+  case SNAP_FALSE:  return BOOL_VAL(false);
+  case SNAP_TRUE:   return BOOL_VAL(true);
+  case SNAP_NUMBER: {
+    double num;
+    readBytes(reader, &num, sizeof(num));
+    return NUMBER_VAL(num);
+  }
+  case SNAP_OBJ: {
+    Obj *obj = readRef(reader, state);
+    return obj != NULL ? OBJ_VAL(obj) : NIL_VAL;
+  }
+  default: return NIL_VAL;
+  }
+}
+
+static void readLocal(Reader *reader, Local *local, Module *module) {
+  uint8_t kind = readU8(reader);
+  uint32_t offset = readU32(reader);
+  local->name.type = (TokenType)readI32(reader);
+  local->name.length = readI32(reader);
+  local->name.line = readI32(reader);
+  local->depth = readI32(reader);
+  local->isCaptured = readU8(reader);
+  local->isReference = readU8(reader);
+
+  switch (kind) {
+  case SNAP_TOK_SOURCE:
+    if (module != NULL && module->source != NULL) {
+      local->name.start = module->source + offset;
+      return;
+    }
+    break;
+  case SNAP_TOK_THIS:  local->name.start = "this"; return;
+  case SNAP_TOK_SUPER: local->name.start = "super"; return;
+  default: break;
+  }
+  local->name.start = "";
+  local->name.length = 0;
+}
+
+static void readFunction(Reader *reader, RestoreState *state,
+                         ObjFunction *function)
+{
+  bool hasCompiler = readU8(reader);
+  function->arity = readI32(reader);
+  function->upvalueCount = readI32(reader);
+  function->name = (ObjString*)readRef(reader, state);
+  Chunk *chunk = &function->chunk;
+  chunk->module = readModuleRef(reader, state);
+
+  uint32_t count = readU32(reader);
+  const uint8_t *code = skipBytes(reader, count);
+  uint32_t lineCount = readU32(reader);
+  if (reader->failed || lineCount > count) {
+    reader->failed = true;
+    return;
+  }
+  chunk->code = ALLOCATE(uint8_t, count);
+  memcpy(chunk->code, code, count);
+  chunk->count = chunk->capacity = count;
+  chunk->lines = ALLOCATE(LineStart, lineCount);
+  for (uint32_t i = 0; i < lineCount; ++i) {
+    chunk->lines[i].offset = readI32(reader);
+    chunk->lines[i].line = readI32(reader);
+  }
+  chunk->lineCount = chunk->lineCapacity = lineCount;
+
+  uint32_t constCount = readU32(reader);
+  for (uint32_t i = 0; i < constCount && !reader->failed; ++i)
+    pushValueArray(&chunk->constants, readValue(reader, state));
+
+  if (!hasCompiler) return;
+
+  Compiler *compiler = chunk->compiler;
+  compiler->type = (FunctionType)readU8(reader);
+  compiler->localCount = readI32(reader);
+  compiler->scopeDepth = readI32(reader);
+  ObjFunction *enclosing = (ObjFunction*)readRef(reader, state);
+  compiler->enclosing = enclosing != NULL ?
+                          enclosing->chunk.compiler : NULL;
+
+  uint32_t localsCnt = readU32(reader);
+  for (uint32_t i = 0; i < localsCnt && i < UINT8_COUNT; ++i)
+    readLocal(reader, &compiler->locals[i], chunk->module);
+
+  for (int i = 0; i < function->upvalueCount && i < UINT8_COUNT; ++i) {
+    compiler->upvalues[i].index = readU8(reader);
+    compiler->upvalues[i].isLocal = readU8(reader);
+  }
+}
+
+// create object shells, pointers get filled in by fillObject
+static Obj *createObject(Reader *reader, RestoreState *state,
+                         uint8_t type)
+{
+  switch (type) {
+  case OBJ_STRING: {
+    uint32_t len = readU32(reader);
+    const uint8_t *chars = skipBytes(reader, len);
+    if (chars == NULL) return NULL;
+    return OBJ_CAST(copyString((const char*)chars, len));
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = newFunction();
+    if (readU8(reader)) {
+      Compiler *compiler = ALLOCATE(Compiler, 1);
+      memset(compiler, 0, sizeof(Compiler));
+      compiler->function = function;
+      function->chunk.compiler = compiler;
+    }
+    return OBJ_CAST(function);
+  }
+  case OBJ_REFERENCE: {
+    ObjReference *ref = ALLOCATE_OBJ(ObjReference, OBJ_REFERENCE);
+    ref->name = NULL;
+    ref->mod = NULL;
+    ref->chunk = NULL;
+    ref->closure = NULL;
+    ref->index = 0;
+    return OBJ_CAST(ref);
+  }
+  case OBJ_MODULE: {
+    Module *module = readModuleRef(reader, state);
+    return module != NULL ? OBJ_CAST(newModule(module)) : NULL;
+  }
+  default:
+    // natives are bound by name later
+    return NULL;
+  }
+}
+
+static void fillObject(Reader *reader, RestoreState *state,
+                       uint32_t idx)
+{
+  Obj *obj = state->objects[idx];
+  switch (state->types[idx]) {
+  case OBJ_FUNCTION:
+    readFunction(reader, state, (ObjFunction*)obj);
+    break;
+  case OBJ_REFERENCE: {
+    ObjReference *ref = (ObjReference*)obj;
+    ref->name = (ObjString*)readRef(reader, state);
+    ref->mod = (ObjModule*)readRef(reader, state);
+    ObjFunction *function = (ObjFunction*)readRef(reader, state);
+    ref->chunk = function != NULL ? &function->chunk : NULL;
+    ref->index = readI32(reader);
+  } break;
+  default: break;
+  }
+}
+
+static void bindNative(Reader *reader, RestoreState *state,
+                       uint32_t idx)
+{
+  ObjString *name = (ObjString*)readRef(reader, state);
+  Value native;
+  if (name != NULL && tableGet(&vm.globals, name, &native) &&
+      IS_NATIVE_FN(native))
+  {
+    state->objects[idx] = AS_OBJ(native);
+  }
+}
+
+static bool moduleUnchanged(const char *path, int64_t mtime,
+                            int64_t size)
+{
+  struct stat st;
+  if (stat(path, &st) != 0) return false;
+  return (int64_t)st.st_mtime == mtime && (int64_t)st.st_size == size;
+}
+
+static void readModuleHeader(Reader *reader, RestoreState *state,
+                             int idx)
+{
+  uint32_t nameLen = readU32(reader);
+  const char *name = (const char*)skipBytes(reader, nameLen);
+  uint32_t pathLen = readU32(reader);
+  const char *path = (const char*)skipBytes(reader, pathLen);
+  int64_t mtime = readI64(reader),
+          size  = readI64(reader),
+          srcLen = readI64(reader);
+  const char *src = (const char*)skipBytes(reader, srcLen);
+  if (reader->failed) return;
+
+  Module *module = ALLOCATE(Module, 1);
+  initModule(module);
+  module->name = copyString(name, nameLen);
+  module->path = copyString(path, pathLen);
+  char *source = ALLOCATE(char, srcLen +1);
+  memcpy(source, src, srcLen);
+  source[srcLen] = '\0';
+  module->source = source;
+
+  if (!moduleUnchanged(module->path->chars, mtime, size)) {
+    // file has changed, let it compile from source again
+    freeModule(module);
+    FREE(Module, module);
+    module = NULL;
+  }
+  state->modules[idx] = module;
+}
+
+static void readModuleBody(Reader *reader, RestoreState *state,
+                           int idx)
+{
+  Module *module = state->modules[idx];
+  ObjFunction *rootFunction = (ObjFunction*)readRef(reader, state);
+  uint32_t exportCnt = readU32(reader);
+  for (uint32_t i = 0; i < exportCnt && !reader->failed; ++i) {
+    ObjString *key = (ObjString*)readRef(reader, state);
+    Value value = readValue(reader, state);
+    if (module != NULL && key != NULL)
+      tableSet(&module->exports, key, value);
+  }
+
+  if (module != NULL && !reader->failed) {
+    module->rootFunction = rootFunction;
+    addModuleVM(module);
+    state->modules[idx] = NULL; // owned by the VM now
+  }
+}
+
+static bool restore(Reader *reader, RestoreState *state) {
+  char magic[sizeof(SNAPSHOT_MAGIC) -1];
+  readBytes(reader, magic, sizeof(magic));
+  if (memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+      readU32(reader) != SNAPSHOT_VERSION ||
+      readU32(reader) != SNAPSHOT_BYTEORDER)
+  {
+    return false;
+  }
+
+  state->moduleCount = readU32(reader);
+  if (reader->failed) return false;
+  state->modules = ALLOCATE(Module*, state->moduleCount);
+  for (int i = 0; i < state->moduleCount; ++i) {
+    state->modules[i] = NULL;
+    readModuleHeader(reader, state, i);
+  }
+
+  state->objectCount = readU32(reader);
+  if (reader->failed ||
+      state->objectCount > (size_t)(reader->end - reader->pos))
+  {
+    return false;
+  }
+  state->objects = ALLOCATE(Obj*, state->objectCount);
+  state->payloads = ALLOCATE(const uint8_t*, state->objectCount);
+  state->types = ALLOCATE(uint8_t, state->objectCount);
+
+  // pass 1, create all objects so pointers can be relocated
+  for (uint32_t i = 0; i < state->objectCount; ++i) {
+    state->types[i] = readU8(reader);
+    uint32_t size = readU32(reader);
+    const uint8_t *payload = skipBytes(reader, size);
+    if (reader->failed) return false;
+    state->payloads[i] = payload;
+    Reader objReader = {payload, payload + size, false};
+    state->objects[i] = createObject(&objReader, state, state->types[i]);
+  }
+
+  // pass 2, bind natives by name, then fill in object pointers
+  for (uint32_t i = 0; i < state->objectCount; ++i) {
+    if (state->types[i] != OBJ_NATIVE_FN) continue;
+    Reader objReader = {state->payloads[i], reader->end, false};
+    bindNative(&objReader, state, i);
+  }
+
+  for (uint32_t i = 0; i < state->objectCount; ++i) {
+    if (state->objects[i] == NULL) continue;
+    Reader objReader = {state->payloads[i], reader->end, false};
+    fillObject(&objReader, state, i);
+  }
+
+  for (int i = 0; i < state->moduleCount; ++i)
+    readModuleBody(reader, state, i);
+
+  uint32_t globalsCnt = readU32(reader);
+  for (uint32_t i = 0; i < globalsCnt && !reader->failed; ++i) {
+    ObjString *key = (ObjString*)readRef(reader, state);
+    Value value = readValue(reader, state);
+    if (key != NULL && !tableHasKey(&vm.globals, key))
+      tableSet(&vm.globals, key, value);
+  }
+
+  return !reader->failed;
+}
+
+// --------------------------------------------------------------
+
+bool writeSnapshot(const char *path) {
+  if (!walkObjects(compilePreparsed)) {
+    fprintf(stderr, "Could not compile functions for snapshot \"%s\".\n",
+            path);
+    return false;
+  }
+
+  memset(&writer, 0, sizeof(writer));
+  writer.file = fopen(path, "wb");
+  if (writer.file == NULL) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  // only modules loaded from a file can be restored
+  int moduleCnt = 0;
+  for (Module *mod = vm.modules; mod != NULL; mod = mod->next)
+    if (mod->path != NULL && mod->rootFunction != NULL) ++moduleCnt;
+
+  writer.modules = ALLOCATE(Module*, moduleCnt);
+  writer.sourceLens = ALLOCATE(size_t, moduleCnt);
+  for (Module *mod = vm.modules; mod != NULL; mod = mod->next) {
+    if (mod->path == NULL || mod->rootFunction == NULL) continue;
+    writer.sourceLens[writer.moduleCount] =
+      mod->source != NULL ? strlen(mod->source) : 0;
+    writer.modules[writer.moduleCount++] = mod;
+  }
+
+  collectObjects();
+
+  writeBytes(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) -1);
+  writeU32(SNAPSHOT_VERSION);
+  writeU32(SNAPSHOT_BYTEORDER);
+
+  writeU32(writer.moduleCount);
+  for (int i = 0; i < writer.moduleCount; ++i)
+    writeModuleHeader(writer.modules[i], writer.sourceLens[i]);
+
+  writeU32(writer.objectCount);
+  for (int i = 0; i < writer.objectCount; ++i)
+    writeObject(writer.objects[i]);
+
+  for (int i = 0; i < writer.moduleCount; ++i) {
+    writeU32(objRef(OBJ_CAST(writer.modules[i]->rootFunction)));
+    writeTable(&writer.modules[i]->exports);
+  }
+  writeTable(&vm.globals);
+
+  bool ok = !ferror(writer.file);
+  fclose(writer.file);
+  freeWriter();
+  if (!ok)
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", path);
+  return ok;
+}
+
+bool restoreSnapshot(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+    return false;
+  }
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  uint8_t *buffer = ALLOCATE(uint8_t, fileSize);
+  size_t bytesRead = fread(buffer, 1, fileSize, file);
+  fclose(file);
+
+  bool enabled = setGCenabled(false);
+  RestoreState state = {0};
+  Reader reader = {buffer, buffer + bytesRead, bytesRead < fileSize};
+  bool ok = !reader.failed && restore(&reader, &state);
+
+  // modules not handed to the VM when restore failed
+  for (int i = 0; i < state.moduleCount && state.modules != NULL; ++i) {
+    if (state.modules[i] == NULL) continue;
+    freeModule(state.modules[i]);
+    FREE(Module, state.modules[i]);
+  }
+  FREE_ARRAY(Module*, state.modules, state.moduleCount);
+  FREE_ARRAY(Obj*, state.objects, state.objectCount);
+  FREE_ARRAY(const uint8_t*, state.payloads, state.objectCount);
+  FREE_ARRAY(uint8_t, state.types, state.objectCount);
+  FREE_ARRAY(uint8_t, buffer, fileSize);
+  setGCenabled(enabled);
+
+  if (!ok)
+    fprintf(stderr, "Snapshot \"%s\" is invalid, ignored.\n", path);
+  return ok;
+}
@@ -0,0 +1,24 @@
+#ifndef LOX_SNAPSHOT_H
+#define LOX_SNAPSHOT_H
+
+#include "common.h"
+
+// A snapshot stores the compiled heap after a run: the interned
+// strings, globals and every loaded module with its compiled
+// functions. Pointers are stored as object indexes and relocated
+// when the snapshot is restored, so a later process can skip
+// readFile and compile for all modules that are unchanged on disk.
+//
+// Native functions and prototypes are C code and are not stored,
+// they get rebound by name to what initVM has already defined. So
+// initVM still runs in full and module top level code runs again on
+// restore, what is saved is reading and compiling the modules.
+
+// write current heap to snapshot file at path
+bool writeSnapshot(const char *path);
+
+// restore heap from snapshot file at path, must be called after initVM
+// modules whose file have changed since snapshot are skipped
+bool restoreSnapshot(const char *path);
+
+#endif // LOX_SNAPSHOT_H
@@ -138,20 +138,42 @@ ObjString *tableFindString(Table *table, const char *chars,
   }
 }
 
+void tableReplaceKey(Table *table, ObjString *key, ObjString *moved) {
+  if (table->count == 0) return;
+
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  if (entry->key != NULL) entry->key = moved;
+}
+
 void tableRemoveWhite(Table *table, ObjFlags flags) {
+  int live = 0;
+  bool removed = false;
   for (int i = 0; i < table->capacity; ++i) {
     Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !(entry->key->obj.flags & flags)) {
+    if (entry->key == NULL) continue;
+    if (!isMarked(&entry->key->obj, flags)) {
       tableDelete(table, entry->key);
-    }
+      removed = true;
+    } else
+      live++;
   }
+
+  // count includes tombstones, rehash when they or free entries
+  // take up most of the table
+  if (!removed || (live >= table->capacity / 4 &&
+                   table->count - live < table->capacity / 4))
+    return;
+  int capacity = GROW_CAPACITY(0);
+  while (live +1 > capacity * TABLE_MAX_LOAD / 2)
+    capacity *= 2;
+  adjustCapacity(table, capacity);
 }
 
 void markTable(Table *table, ObjFlags flags) {
   for (int i = 0; i < table->capacity; ++i) {
     Entry *entry = &table->entries[i];
-    markObject(OBJ_CAST(entry->key), flags);
-    markValue(entry->value, flags);
+    markObject(OBJ_SLOT(entry->key), flags);
+    markValue(&entry->value, flags);
   }
 }
 
@@ -25,6 +25,9 @@ bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash);
+// point the entry of key at moved, a copy with the same hash
+void tableReplaceKey(Table *table, ObjString *key, ObjString *moved);
+// delete entries with unmarked keys, shrinks table when sparse
 void tableRemoveWhite(Table *table, ObjFlags flags);
 void markTable(Table *table, ObjFlags flags);
 
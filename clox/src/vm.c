@@ -40,7 +40,7 @@ static InterpretResult runtimeError(const char *format, ...) {
     ObjFunction *function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code -1;
     fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+            getChunkLine(&function->chunk, instruction));
 
     const char *fnname = function->name != NULL ?
                    function->name->chars : "script";
@@ -58,6 +58,16 @@ static bool call(ObjClosure *closure, int argCount) {
       return false;
   }
 
+  // only preparsed, compile body on first call
+  Compiler *compiler = closure->function->chunk.compiler;
+  if (compiler != NULL && compiler->bodyStart != NULL &&
+      !compileFunctionBody(closure->function))
+  {
+    runtimeError("Could not compile function '%s'.",
+                 closure->function->name->chars);
+    return false;
+  }
+
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
@@ -65,6 +75,19 @@ static bool call(ObjClosure *closure, int argCount) {
   return true;
 }
 
+// ropes only live in variables, code looking at the characters or
+// storing into arrays, dicts and fields gets the string
+static Value flatValue(Value value) {
+  if (IS_ROPE(value))
+    return OBJ_VAL(OBJ_CAST(flattenRope(AS_ROPE(value))));
+  return value;
+}
+
+static void flatArgs(int argCount) {
+  for (Value *arg = vm.stackTop - argCount; arg < vm.stackTop; ++arg)
+    *arg = flatValue(*arg);
+}
+
 static bool callValue(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
@@ -93,6 +116,7 @@ static bool callValue(Value callee, int argCount) {
         runtimeError("%s requires %d arguments.", nativeFn->name, nativeFn->arity);
         return false;
       }
+      flatArgs(argCount);
       Value result = nativeFn->function(argCount, vm.stackTop - argCount);
       vm.stackTop -= argCount +1;
       push(result);
@@ -104,6 +128,7 @@ static bool callValue(Value callee, int argCount) {
         runtimeError("%s requires %d arguments.", nativeMethod->name->chars, nativeMethod->arity);
         return false;
       }
+      flatArgs(argCount +1);
       Value *args = vm.stackTop - argCount;
       Value obj = vm.stackTop[-argCount -1];
       Value result = nativeMethod->method(obj, argCount, args);
@@ -116,6 +141,7 @@ static bool callValue(Value callee, int argCount) {
     case OBJ_STRING: case OBJ_UPVALUE:
     case OBJ_INSTANCE: case OBJ_FUNCTION:
     case OBJ_MODULE: case OBJ_REFERENCE:
+    case OBJ_ROPE:
      break; // non callable object type
     }
   }
@@ -137,6 +163,7 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name,
 }
 
 static bool invoke(ObjString *name, int argCount) {
+  vm.stackTop[-argCount -1] = flatValue(peek(argCount));
   Value reciever = peek(argCount);
   Table *fields = NULL;
   Value value;
@@ -207,8 +234,10 @@ static void closeUpvalues(Value *last) {
          vm.openUpvalues->location >= last)
   {
     ObjUpvalue *upvalue = vm.openUpvalues;
+    PRE_WRITE_BARRIER(upvalue);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    WRITE_BARRIER(upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -216,26 +245,23 @@ static void closeUpvalues(Value *last) {
 static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
+  PRE_WRITE_BARRIER(klass);
   tableSet(&klass->methods, name, method);
+  WRITE_BARRIER(klass, method);
   pop();
 }
 
 static void concatenate() {
-  ObjString *b = AS_STRING(peek(0)), // peek because of GC
-            *a = AS_STRING(peek(1));
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length +1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString *result = takeString(chars, length);
+  Obj *b = AS_OBJ(peek(0)), // peek because of GC
+      *a = AS_OBJ(peek(1));
+  Obj *result = concatenateStrings(a, b);
   pop(); // for GC
   pop();
-  push(OBJ_VAL(OBJ_CAST(result)));
+  push(OBJ_VAL(result));
 }
 
 static void loadUpvalues(CallFrame *frame, ObjClosure *closure) {
+  PRE_WRITE_BARRIER(closure);
   for (int i = 0; i < closure->upvalueCount; ++i) {
     Upvalue *upVlu = &closure->function->chunk.compiler->upvalues[i];
     uint8_t isLocal = upVlu->isLocal,
@@ -246,6 +272,8 @@ static void loadUpvalues(CallFrame *frame, ObjClosure *closure) {
     } else {
       closure->upvalues[i] = frame->closure->upvalues[index];
     }
+    if (closure->upvalues[i] != NULL)
+      WRITE_BARRIER(closure, OBJ_VAL(OBJ_CAST(closure->upvalues[i])));
   }
 }
 
@@ -288,6 +316,14 @@ static InterpretResult run() {
 # define DBG_NEXT \
   if (debugger.state > DBG_RUN) onNextTick(instruction)
 
+  // objects move in a collect, it's only safe where nothing but the
+  // VM holds them, C callers of a nested run root theirs, see pushRoot
+# define GC_SAFEPOINT \
+  if (vm.gcPending) { \
+    importModule = NULL; \
+    gcSafepoint(); \
+  }
+
 #ifdef COMPUTED_GOTO
 # define OP(opcode)  &&lbl_##opcode
 # define CASE(inst)   lbl_##inst:
@@ -368,7 +404,7 @@ static InterpretResult run() {
     } BREAK;
     CASE(OP_GET_PROPERTY) {
       Table *tbl = NULL;
-      Value obj = pop();
+      Value obj = flatValue(pop());
       ObjString *name = READ_STRING();
       if (IS_DICT(obj)) {
         tbl = &AS_DICT(obj)->fields;
@@ -395,7 +431,7 @@ static InterpretResult run() {
 
     } BREAK;
     CASE(OP_GET_INDEXER) {
-      Value key = pop(), obj = pop();
+      Value key = flatValue(pop()), obj = flatValue(pop());
       Value method = objMethodNative(AS_OBJ(obj), copyString("__getitem__", 11));
       if (!IS_NIL(method)) {
         push(AS_NATIVE_METHOD(method)->method(obj, 1, &key));
@@ -439,7 +475,10 @@ static InterpretResult run() {
     CASE(OP_SET_UPVALUE) {
       DBG_NEXT;
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      PRE_WRITE_BARRIER(upvalue);
+      *upvalue->location = peek(0);
+      WRITE_BARRIER(upvalue, peek(0));
     } BREAK;
     CASE(OP_SET_PROPERTY) {
       DBG_NEXT;
@@ -447,6 +486,7 @@ static InterpretResult run() {
       Value value = pop(), obj = pop();
       ObjString *name = READ_STRING();
       if (IS_DICT(obj)) {
+        value = flatValue(value);
         tbl = &AS_DICT(obj)->fields;
       } else if (IS_INSTANCE(obj)) {
         tbl = &AS_INSTANCE(obj)->fields;
@@ -454,10 +494,13 @@ static InterpretResult run() {
       if (tbl && !tableHasKey(tbl, name)) {
         // lookup in prototype chain
         Value prop = objPropNative(AS_OBJ(obj), name);
+        PRE_WRITE_BARRIER(AS_OBJ(obj));
         if (!IS_NIL(prop) && AS_NATIVE_PROP(prop)->setFn) {
           AS_NATIVE_PROP(prop)->setFn(obj, &value);
-        } else
+        } else {
           tableSet(tbl, name, value);
+          WRITE_BARRIER(AS_OBJ(obj), value);
+        }
         push(value);
       } else
         return runtimeError("Could not set '%s' to object.\n", name->chars);
@@ -465,7 +508,8 @@ static InterpretResult run() {
     } BREAK;
     CASE(OP_SET_INDEXER) {
       DBG_NEXT;
-      Value value = pop(), key = pop(), obj = pop();
+      Value value = flatValue(pop()), key = flatValue(pop()),
+            obj = flatValue(pop());
       Value method = objMethodNative(AS_OBJ(obj), copyString("__setitem__", 11));
       if (!IS_NIL(method)) {
         Value args[] = {key, value};
@@ -476,14 +520,16 @@ static InterpretResult run() {
     } BREAK;
     CASE(OP_EQUAL) {
       DBG_NEXT;
-      Value b = pop(), a = pop();
+      Value b = flatValue(pop()), a = flatValue(pop());
       push(BOOL_VAL(valuesEqual(a, b)));
     } BREAK;
     CASE(OP_GREATER) DBG_NEXT; BINARY_OP(BOOL_VAL, >); BREAK;
     CASE(OP_LESS)    DBG_NEXT; BINARY_OP(BOOL_VAL, <); BREAK;
     CASE(OP_ADD) {
       DBG_NEXT;
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      if ((IS_STRING(peek(0)) || IS_ROPE(peek(0))) &&
+          (IS_STRING(peek(1)) || IS_ROPE(peek(1))))
+      {
         concatenate();
       } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
         BINARY_OP(NUMBER_VAL, +);
@@ -524,6 +570,7 @@ static InterpretResult run() {
       DBG_NEXT;
       uint16_t offset = READ_SHORT();
       frame->ip -= offset;
+      GC_SAFEPOINT;
     } BREAK;
     CASE(OP_CALL) {
       DBG_NEXT;
@@ -537,6 +584,7 @@ static InterpretResult run() {
       }
 
       frame = &vm.frames[vm.frameCount -1];
+      GC_SAFEPOINT;
     } BREAK;
     CASE(OP_INVOKE) {
       DBG_NEXT;
@@ -581,6 +629,7 @@ static InterpretResult run() {
 
       push(result);
       frame = &vm.frames[vm.frameCount -1];
+      GC_SAFEPOINT;
     } BREAK;
     CASE(OP_EVAL_EXIT) {
       vm.frameCount--;
@@ -597,8 +646,10 @@ static InterpretResult run() {
         return runtimeError("Superclass must be a class.");
 
       ObjClass* subClass = AS_CLASS(peek(0));
+      PRE_WRITE_BARRIER(subClass);
       tableAddAll(&AS_CLASS(superClass)->methods,
                   &subClass->methods);
+      writeBarrierObject(OBJ_CAST(subClass));
       pop(); // subclass;
     } BREAK;
     CASE(OP_METHOD)
@@ -611,8 +662,12 @@ static InterpretResult run() {
       BREAK;
     CASE(OP_DICT_FIELD) {
       DBG_NEXT;
-      Table *fields = &AS_DICT(peek(1))->fields;
-      tableSet(fields, READ_STRING(), pop());
+      vm.stackTop[-1] = flatValue(peek(0));
+      ObjDict *dict = AS_DICT(peek(1));
+      PRE_WRITE_BARRIER(dict);
+      tableSet(&dict->fields, READ_STRING(), peek(0));
+      WRITE_BARRIER(dict, peek(0));
+      pop();
     } BREAK;
     CASE(OP_DEFINE_ARRAY)
       DBG_NEXT;
@@ -620,15 +675,22 @@ static InterpretResult run() {
       BREAK;
     CASE(OP_ARRAY_PUSH) {
       DBG_NEXT;
-      ValueArray *array = &AS_ARRAY(peek(1))->arr;
-      pushValueArray(array, pop());
+      vm.stackTop[-1] = flatValue(peek(0));
+      ObjArray *array = AS_ARRAY(peek(1));
+      PRE_WRITE_BARRIER(array);
+      pushValueArray(&array->arr, peek(0));
+      WRITE_BARRIER(array, peek(0));
+      pop();
     } BREAK;
     CASE(OP_IMPORT_MODULE) {
       DBG_NEXT;
       TRACE_MODULE_LOAD
       Value path = READ_CONSTANT();
       assert(IS_STRING(path));
+      // the module's top level code runs nested and might collect
+      pushRoot(&path);
       importModule = AS_MODULE(getModuleByPath(path));
+      popRoot();
       TRACE_MODULE_LOADED
       if (importModule == NULL)
         return runtimeError("Failed to load script from: %s\n", AS_CSTRING(path));
@@ -651,12 +713,17 @@ static InterpretResult run() {
       ObjString *ident = AS_STRING(READ_CONSTANT());
       uint8_t localIdx = READ_BYTE(),
               upIdx    = READ_BYTE();
-      frame->closure->upvalues[upIdx] = captureUpvalue(&frame->slots[localIdx]);
+      ObjUpvalue *upvalue = captureUpvalue(&frame->slots[localIdx]);
+      PRE_WRITE_BARRIER(frame->closure);
+      frame->closure->upvalues[upIdx] = upvalue;
+      WRITE_BARRIER(frame->closure, OBJ_VAL(OBJ_CAST(upvalue)));
       Value ref;
       if (tableGet(&frame->closure->function->chunk.module->exports,
                    ident, &ref))
       {
+        PRE_WRITE_BARRIER(AS_OBJ(ref));
         AS_REFERENCE(ref)->closure = frame->closure;
+        WRITE_BARRIER(AS_OBJ(ref), OBJ_VAL(OBJ_CAST(frame->closure)));
       }
     }
     }
@@ -667,6 +734,16 @@ static InterpretResult run() {
 #undef READ_STRING
 #undef BINARY_OP
 #undef CASE
+#undef GC_SAFEPOINT
+}
+
+static void unindexModule(Table *table, ObjString *key, Module *module) {
+  Value value;
+  if (key != NULL && tableGet(table, key, &value) &&
+      AS_MODULE(value)->module == module)
+  {
+    tableDelete(table, key);
+  }
 }
 
 // -------------------------------------------------------
@@ -675,20 +752,25 @@ void initVM() {
   initTable(&vm.strings);
   initTable(&vm.globals);
   resetStack();
-  vm.infantObjects = vm.olderObjects = NULL;
+  vm.rootCount = 0;
+  vm.olderObjects = NULL;
+  vm.gcPending = false;
   vm.infantBytesAllocated = 0;
   vm.olderBytesAllocated = 0;
-  vm.infantNextGC = INFANT_GC_MIN;
-  vm.olderNextGC = OLDER_GC_MIN;
+  initGCThresholds();
   vm.frameCount = vm.exitAtFrame = 0;
   vm.modules = NULL;
+  initTable(&vm.modulesByPath);
 
+  // held from C for the whole run, must never move
+  bool older = setAllocateOlder(true);
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
   initTypes();
   initDebugger();
 
   defineBuiltins();
+  setAllocateOlder(older);
 }
 
 void freeVM() {
@@ -701,6 +783,8 @@ void freeVM() {
     FREE(Module, freeMod);
   }
 
+  freeTable(&vm.modulesByPath);
+  freeModuleResolveCache();
   freeTable(&vm.strings);
   freeTable(&vm.globals);
   freeObjectsModule();
@@ -767,18 +851,32 @@ InterpretResult vm_eval(Value *value, const char *source) {
 }
 
 void addModuleVM(Module *module) {
+  bool enabled = setGCenabled(false);
   module->next = vm.modules;
   vm.modules = module;
+
+  ObjModule *omod = newModule(module);
+  if (module->path != NULL) {
+    // a path not on disk (yet) is indexed as given
+    module->canonicalPath = resolveModulePath(module->path);
+    if (module->canonicalPath == NULL)
+      module->canonicalPath = module->path;
+    tableSet(&vm.modulesByPath, module->canonicalPath,
+             OBJ_VAL(OBJ_CAST(omod)));
+  }
+  setGCenabled(enabled);
 }
 
 Module *getModule(const char *path) {
-  Module *mod = vm.modules;
-  while (mod != NULL) {
-    if (memcmp(mod->path->chars, path, mod->path->length) == 0) {
-      return mod;
-    }
-  }
-  return NULL;
+  if (path == NULL) return NULL;
+  bool enabled = setGCenabled(false);
+  ObjString *key = copyString(path, strlen(path));
+  ObjString *canonical = resolveModulePath(key);
+  Value value;
+  bool found = tableGet(&vm.modulesByPath,
+                        canonical != NULL ? canonical : key, &value);
+  setGCenabled(enabled);
+  return found ? AS_MODULE(value)->module : NULL;
 }
 
 Module *getCurrentModule() {
@@ -786,37 +884,42 @@ Module *getCurrentModule() {
 }
 
 void delModuleVM(Module *module) {
-  if (vm.modules == NULL) return;
-
-  Module **next = &vm.modules;
-  do {
+  for (Module **next = &vm.modules; *next != NULL; next = &(*next)->next) {
     if (*next == module) {
-      *next = (*next)->next;
+      *next = module->next;
+      unindexModule(&vm.modulesByPath, module->canonicalPath, module);
       freeModule(module);
       return;
     }
-  } while ((*next = (*next)->next));
+  }
 }
 
 void markRootsVM(ObjFlags flags) {
   for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
-    markValue(*slot, flags);
+    markValue(slot, flags);
   }
 
   for (int i = 0; i < vm.frameCount; ++i) {
-    markObject(OBJ_CAST(vm.frames[i].closure), flags);
+    markObject(OBJ_SLOT(vm.frames[i].closure), flags);
+  }
+
+  for (int i = 0; i < vm.rootCount; ++i) {
+    markValue(vm.roots[i], flags);
   }
 
-  for (ObjUpvalue *upvalue = vm.openUpvalues;
-       upvalue != NULL;
-       upvalue = upvalue->next)
+  // the links too, an infant collect moves open upvalues
+  for (ObjUpvalue **upvalue = &vm.openUpvalues;
+       *upvalue != NULL;
+       upvalue = &(*upvalue)->next)
   {
-    markObject(OBJ_CAST(upvalue), flags);
+    markObject(OBJ_SLOT(*upvalue), flags);
   }
 
-  markObject(OBJ_CAST(vm.initString), flags);
-  markTable(&vm.strings, flags);
+  // vm.strings is weak, interned strings are kept by their users
+  markObject(OBJ_SLOT(vm.initString), flags);
   markTable(&vm.globals, flags);
+  markTable(&vm.modulesByPath, flags);
+  markModuleResolveCache(flags);
 
   Module *mod = vm.modules;
   while (mod != NULL) {
@@ -848,6 +951,16 @@ Value pop() {
   return *vm.stackTop;
 }
 
+void pushRoot(Value *slot) {
+  assert(vm.rootCount < ROOTS_MAX && "Too many roots held by C code.");
+  vm.roots[vm.rootCount++] = slot;
+}
+
+void popRoot() {
+  assert(vm.rootCount > 0 && "Popped root below zero.");
+  vm.rootCount--;
+}
+
 Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
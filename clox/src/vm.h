@@ -10,6 +10,7 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define ROOTS_MAX 16
 
 typedef struct {
   ObjClosure *closure;
@@ -17,26 +18,39 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
+// growable stack of objects the GC still has to visit
+typedef struct {
+  int   count,
+        capacity;
+  Obj** objects;
+} ObjStack;
+
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int    frameCount,
          exitAtFrame;
   Value  stack[STACK_MAX];
   Value* stackTop;
+  // C locals held across a nested run, a collect updates them
+  Value* roots[ROOTS_MAX];
+  int    rootCount;
   Table  strings;
   Table  globals;
   Module  *modules;
+  Table  modulesByPath; // canonical path -> ObjModule
   ObjString *initString;
   ObjUpvalue* openUpvalues;
   size_t infantBytesAllocated,
          olderBytesAllocated,
          infantNextGC,
          olderNextGC;
-  Obj   *infantObjects,
-        *olderObjects;
-  int   grayCount,
-        grayCapacity;
-  Obj** grayStack;
+  Obj   *olderObjects; // those not in pool pages, infants live in the nursery
+  bool  gcPending,    // collect at next safepoint
+        gcMarking;    // incremental older marking in progress
+  ObjStack gray,       // marked older objects with fields left to trace
+           scan,       // copied out infants with fields left to evacuate
+           remembered, // older objects that might point to infants
+           infantStrings; // interned strings in the nursery
 } VM;
 
 typedef enum InterpretResult {
@@ -93,4 +107,10 @@ Value pop();
 // peek into stack
 Value peek(int distance);
 
+// keep the value in slot alive and moved along while code runs nested
+void pushRoot(Value *slot);
+
+// stop rooting the slot pushed last
+void popRoot();
+
 #endif // CLOX_VM_H
@@ -0,0 +1,108 @@
+print("scan_benchmark.py")
+# Generates a large lox source and times how fast clox gets through it.
+#
+#   python3 scan_benchmark.py [clox] [lines] [runs]
+#
+# clox defaults to ../clox/build/clox, build it with DEBUG_PRINT_CODE
+# and DEBUG_TRACE_EXECUTION commented out in common.h or the timings
+# are mostly printing. The functions are never called, so
+#   -L      checks the bodies, scanning and parsing, but keeps no code
+#   eager   scans and compiles everything
+#   scan    is the scan phase of --compile-stats, if clox has it
+# Each is the cpu time of the fastest of runs, process start and
+# reading the file included. The scan phase reads the clock for each
+# token, which --compile-stats adds to what it measures.
+import os
+import random
+import re
+import resource
+import subprocess
+import sys
+import tempfile
+
+clox = sys.argv[1] if len(sys.argv) > 1 else \
+  os.path.join(os.path.dirname(os.path.abspath(__file__)), "../clox/build/clox")
+lines = int(sys.argv[2]) if len(sys.argv) > 2 else 300000
+runs = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+
+def block(rnd, nr):
+  # 18 lines with most kinds of tokens, values come from short lists
+  # so the constants are shared within a function
+  return ("  // block number %d, comments are skipped by the scanner\n"
+          "  {\n"
+          "    var count = %d;\n"
+          "    var text = \"a string literal with some length\";\n"
+          "    var ratio = %d.5 * first - second / 3.25;\n"
+          "    while (count > 0 and ratio != nil) {\n"
+          "      if (count == %d or !(first >= second)) {\n"
+          "        text = text + \"x\";\n"
+          "      } else {\n"
+          "        ratio = -ratio + (count * 2);\n"
+          "      }\n"
+          "      count = count - 1;\n"
+          "    }\n"
+          "    for (var i = 0; i < %d; i = i + 1) first = first + i;\n"
+          "    var items = [first, second, \"third\", true, false];\n"
+          "    var dict = {key: text, other: ratio};\n"
+          "  }\n") % (nr, rnd.randint(1, 20), rnd.randint(0, 9),
+                      rnd.randint(0, 20), rnd.randint(1, 20))
+
+
+def generate(path):
+  rnd = random.Random(1)
+  with open(path, "w") as file:
+    # a chunk holds 256 constants and -L only preparses functions
+    # declared in the script, so there are few but long functions
+    written, nr = 0, 0
+    while written < lines:
+      file.write("fun generated%d(first, second) {\n" % nr)
+      for _ in range(200):
+        file.write(block(rnd, nr))
+        nr += 1
+      file.write("  return first;\n}\n\n")
+      written += 200 * 18 + 4
+    file.write("print \"done\";\n")
+
+
+def cpuTime():
+  usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+  return usage.ru_utime + usage.ru_stime
+
+
+# cpu time of the fastest run, steadier than wall time
+def best(args, required=True):
+  fastest, stats = None, ""
+  for _ in range(runs):
+    start = cpuTime()
+    result = subprocess.run(args, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, text=True)
+    elapsed = cpuTime() - start
+    if result.returncode != 0:
+      if not required:
+        return None, ""
+      sys.exit("%s failed:\n%s" % (" ".join(args), result.stderr[:2000]))
+    if fastest is None or elapsed < fastest:
+      fastest, stats = elapsed, result.stderr
+  return fastest, stats
+
+
+with tempfile.TemporaryDirectory() as tmp:
+  source = os.path.join(tmp, "generated.lox")
+  generate(source)
+  mb = os.path.getsize(source) / 1e6
+  print("%s: %d lines, %.1f MB, best of %d" % (clox, lines, mb, runs))
+
+  for name, args in (("-L", [clox, "-L", source]),
+                     ("eager", [clox, source])):
+    elapsed, _ = best(args)
+    print("  %-6s %8.3f s  %7.1f MB/s" % (name, elapsed, mb / elapsed))
+
+  elapsed, stats = best([clox, "--compile-stats", source], False)
+  scan = re.search(r"scan\s+([0-9.]+) ms\s+(\d+) tokens", stats)
+  if scan:
+    ms, tokens = float(scan.group(1)), int(scan.group(2))
+    print("  %-6s %8.3f s  %7.1f MB/s  %.1f M tokens/s" %
+          ("scan", ms / 1000, mb / (ms / 1000), tokens / ms / 1000))
+  else:
+    print("  scan   not reported, clox has no --compile-stats")
@@ -0,0 +1,43 @@
+print("test_gc_pause.py")
+# Runs test_gc_pause.lox stop the world and with --gc-pause, fails
+# when incremental marking falls behind, seen as far fewer older
+# collects and a larger peak memory than stop the world.
+#
+#   python3 test_gc_pause.py [clox]
+#
+# clox defaults to ../clox/build/clox, build it with DEBUG_PRINT_CODE
+# and DEBUG_TRACE_EXECUTION commented out in common.h.
+import os
+import re
+import subprocess
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+clox = sys.argv[1] if len(sys.argv) > 1 else \
+  os.path.join(here, "../clox/build/clox")
+script = os.path.join(here, "test_gc_pause.lox")
+
+
+# older collects and peak rss in MB of one run
+def run(args):
+  process = subprocess.Popen([clox] + args + [script],
+                             stdout=subprocess.PIPE, text=True)
+  out = process.stdout.read()
+  _, status, usage = os.wait4(process.pid, 0)
+  collects = re.search(r"older collects (\d+)", out)
+  if status != 0 or not collects:
+    sys.exit("%s failed:\n%s" % (" ".join(args), out[-2000:]))
+  return int(collects.group(1)), usage.ru_maxrss / 1024
+
+
+collects, rss = run([])
+print("  %-16s %3d older collects %6.0f MB" % ("stop the world", collects, rss))
+failed = False
+for pause in ("50", "200", "2000"):
+  arg = "--gc-pause=" + pause
+  pauseCollects, pauseRss = run([arg])
+  ok = pauseCollects * 4 >= collects * 3 and pauseRss <= rss * 1.5
+  failed = failed or not ok
+  print("  %-16s %3d older collects %6.0f MB %s" %
+        (arg, pauseCollects, pauseRss, "ok" if ok else "FAILED"))
+sys.exit(1 if failed else 0)